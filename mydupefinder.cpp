@@ -29,6 +29,32 @@
 #include <filesystem>
 #include <stdexcept>
 #include <limits>
+#include <cmath>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <unordered_set>
+#include <map>
+#include <set>
+#include <queue>
+#include <thread>
+#include <functional>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <fnmatch.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cerrno>
 
 #define CRYPTOPP_ENABLE_NAMESPACE_WEAK 1
 #include <cryptopp/md5.h>
@@ -36,77 +62,3622 @@
 #include <cryptopp/hex.h>
 #include <cryptopp/files.h>
 #include <cryptopp/sha.h>
+#include <cryptopp/gzip.h>
+#include <cryptopp/zinflate.h>
+
+#ifdef MYDUPEFINDER_WITH_EXT2FS
+#include <ext2fs/ext2fs.h>
+#endif
+
+// Separator between an archive path and a member name in virtual member paths,
+// e.g. /backup/libs.zip!/lib/commons-io.jar
+const std::string ARCHIVE_MEMBER_SEPARATOR = "!/";
+
+// How often a file that changed while being hashed is re-queued before giving up
+const int MAX_HASH_RETRIES = 3;
+
+// Errors printed to the console before the rest only go to the log file
+const size_t MAX_CONSOLE_ERRORS = 20;
+
+// First line of a partial scan result written by "scan --shard"
+const std::string SHARD_MAGIC = "mydupefinder-shard 2";
+
+// Bytes read for a head (or tail) probe when a size bucket is pre-filtered
+const uint64_t PARTIAL_HASH_BYTES = 64 * 1024;
+
+// Marks a record whose digest is not in the compact index side file
+const uint32_t NO_DIGEST_SLOT = std::numeric_limits<uint32_t>::max();
+
+// Largest bucket the planner will compare byte by byte, and the chunk size it reads
+const size_t LOCKSTEP_MAX_FILES = 8;
+const size_t LOCKSTEP_CHUNK_BYTES = 1024 * 1024;
+
+// Planner read-rate calibration: bytes timed per device, the smallest file sampled
+// and how many of a device's largest files are tried before keeping the default
+const uint64_t CALIBRATION_BYTES = 8 * 1024 * 1024;
+const uint64_t CALIBRATION_MIN_BYTES = 1024 * 1024;
+const size_t CALIBRATION_CANDIDATES = 4;
+
+// -prefix-copies: offset of the first hash checkpoint; the following ones double it.
+// A file also gets checkpoints at the sizes of up to PREFIX_NEIGHBOR_CHECKPOINTS
+// smaller files in its directory (the next smaller sizes first).
+const uint64_t PREFIX_CHECKPOINT_MIN_BYTES = 4096;
+const size_t PREFIX_NEIGHBOR_CHECKPOINTS = 32;
+
+// Per-filesystem directory that -quarantine renames duplicates into, and how the
+// purger frees them: at most this many bytes per truncate, then a pause
+const std::string QUARANTINE_DIR_NAME = ".mydupefinder-quarantine";
+const off_t PURGE_STEP_BYTES = 256 * 1024 * 1024;
+const int PURGE_STEP_PAUSE_MS = 100;
+
+// -ext4-image: bytes requested per libext2fs read while hashing an image member
+const unsigned int IMAGE_READ_BYTES = 1024 * 1024;
+
+// ------------------------------------------------------------------------------------
+// Function: getCurrentDateTime
+// Retrieves the current date and time in the format YYYYMMDDHHMMSS
+// ------------------------------------------------------------------------------------
+std::string getCurrentDateTime() {
+    std::time_t now = std::time(nullptr);
+    std::tm *ltm = std::localtime(&now);
+    char buf[16];
+    std::strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", ltm);
+    return std::string(buf);
+}
+
+// ------------------------------------------------------------------------------------
+// Function: formatDuration
+// Formats a given duration (in seconds) into the format h,mm,ss
+// ------------------------------------------------------------------------------------
+std::string formatDuration(int seconds) {
+    int h = seconds / 3600;
+    int m = (seconds % 3600) / 60;
+    int s = seconds % 60;
+    std::ostringstream oss;
+    oss << h << "h," << std::setfill('0') << std::setw(2) << m << "m," << std::setw(2) << s << "s";
+    return oss.str();
+}
+
+// ------------------------------------------------------------------------------------
+// Function: formatBytes
+// Formats a byte count with a binary unit, e.g. 1.5 GiB
+// ------------------------------------------------------------------------------------
+std::string formatBytes(uint64_t bytes) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB"};
+    double value = (double)bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 5) {
+        value /= 1024;
+        unit++;
+    }
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << value << " " << units[unit];
+    return oss.str();
+}
+
+// ------------------------------------------------------------------------------------
+// Class: ErrorLog
+// Records per-entry errors so that one bad file or directory never aborts a run.
+// Every error goes to the log file as "<what> <path> - <message>", the first
+// MAX_CONSOLE_ERRORS also to the console, and the counts per kind are summarized
+// at the end. Safe to use from worker threads.
+// ------------------------------------------------------------------------------------
+class ErrorLog {
+public:
+    void attach(std::ostream& logFile) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        log_ = &logFile;
+    }
+
+    void add(const std::string& what, const std::string& path, const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        counts_[what]++;
+        total_++;
+        if (log_)
+            *log_ << what << " " << path << " - " << message << "\n";
+        if (total_ <= MAX_CONSOLE_ERRORS) {
+            std::cerr << what << " " << path << " - " << message << "\n";
+        } else if (total_ == MAX_CONSOLE_ERRORS + 1) {
+            std::cerr << "More errors follow; they are only written to the log file.\n";
+        }
+    }
+
+    size_t count() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return total_;
+    }
+
+    void summarize(std::ostream& out) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (total_ == 0)
+            return;
+        out << total_ << " errors (";
+        bool first = true;
+        for (const auto &[what, count] : counts_) {
+            out << (first ? "" : ", ") << what << ": " << count;
+            first = false;
+        }
+        out << ")\n";
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::ostream *log_ = nullptr;
+    std::map<std::string, size_t> counts_;
+    size_t total_ = 0;
+};
+
+ErrorLog errorLog;
+
+// ------------------------------------------------------------------------------------
+// Function: createHashFunction
+// Creates a hash object for the given algorithm (MD5 or SHA-256)
+// ------------------------------------------------------------------------------------
+std::unique_ptr<CryptoPP::HashTransformation> createHashFunction(const std::string& algorithm) {
+    if (algorithm == "MD5") {
+        return std::make_unique<CryptoPP::Weak::MD5>();
+    } else if (algorithm == "SHA-256") {
+        return std::make_unique<CryptoPP::SHA256>();
+    }
+    throw std::invalid_argument("Invalid hash algorithm: " + algorithm);
+}
+
+// ------------------------------------------------------------------------------------
+// Function: isRotationalDevice
+// Reads the rotational flag of a block device from sysfs (a partition uses its disk's)
+// ------------------------------------------------------------------------------------
+bool isRotationalDevice(dev_t device) {
+    std::string base = "/sys/dev/block/" + std::to_string(major(device)) + ":" + std::to_string(minor(device));
+    for (const char *suffix : {"/queue/rotational", "/../queue/rotational"}) {
+        std::ifstream flag(base + suffix);
+        int value;
+        if (flag >> value)
+            return value == 1;
+    }
+    return false;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: physicalOffset
+// Physical byte offset of a file's first extent (FIEMAP), used to read files in disk
+// order. Returns 0 if the filesystem cannot tell.
+// ------------------------------------------------------------------------------------
+uint64_t physicalOffset(int fd) {
+    alignas(struct fiemap) char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+    struct fiemap *map = reinterpret_cast<struct fiemap*>(buf);
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0)
+        return map->fm_extents[0].fe_physical;
+    return 0;
+}
+
+uint64_t physicalOffset(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+    uint64_t offset = physicalOffset(fd);
+    close(fd);
+    return offset;
+}
+
+// ------------------------------------------------------------------------------------
+// Struct: IoProfile
+// How files on one filesystem are read: files in flight, read size, mmap or pread,
+// whether files are read in physical (FIEMAP) order, and the page-cache advice
+// ------------------------------------------------------------------------------------
+struct IoProfile {
+    enum Advice { ADVICE_NONE, ADVICE_SEQUENTIAL, ADVICE_NOREUSE };
+
+    std::string name = "unknown filesystem";
+    int queue_depth = 1;
+    size_t block_size = 1024 * 1024;
+    bool use_mmap = false;
+    bool physical_order = false;
+    Advice advice = ADVICE_SEQUENTIAL;
+
+    std::string describe() const {
+        static const char *advice_names[] = {"none", "sequential", "noreuse"};
+        std::ostringstream oss;
+        oss << name << ": " << queue_depth << (queue_depth == 1 ? " file" : " files") << " in flight, "
+            << formatBytes(block_size) << " blocks, " << (use_mmap ? "mmap" : "pread") << ", "
+            << (physical_order ? "physical" : "walk") << " order, fadvise " << advice_names[advice];
+        return oss.str();
+    }
+
+    // Applies one "key=value" setting; returns false if the key or value is invalid
+    bool set(const std::string& key, const std::string& value) {
+        try {
+            if (key == "qd") {
+                queue_depth = std::max(1, std::stoi(value));
+            } else if (key == "block") {
+                size_t unit = 1;
+                if (!value.empty() && (value.back() == 'K' || value.back() == 'k'))
+                    unit = 1024;
+                if (!value.empty() && (value.back() == 'M' || value.back() == 'm'))
+                    unit = 1024 * 1024;
+                block_size = std::max<size_t>(4096, std::stoull(value) * unit);
+            } else if (key == "read" && (value == "mmap" || value == "pread")) {
+                use_mmap = value == "mmap";
+            } else if (key == "order" && (value == "physical" || value == "walk")) {
+                physical_order = value == "physical";
+            } else if (key == "fadvise" && (value == "none" || value == "sequential" || value == "noreuse")) {
+                advice = value == "none" ? ADVICE_NONE : value == "sequential" ? ADVICE_SEQUENTIAL : ADVICE_NOREUSE;
+            } else {
+                return false;
+            }
+        } catch (const std::exception &e) {
+            return false;
+        }
+        return true;
+    }
+};
+
+// ------------------------------------------------------------------------------------
+// Class: IoProfiles
+// Picks the I/O profile of each device once, from the filesystem type (statfs) and,
+// for local disks, the rotational flag:
+//   tmpfs/ramfs      CPU-bound: one file per core, no page-cache advice
+//   local SSD        4 files in flight, 1 MiB pread, sequential readahead
+//   local HDD        1 file at a time in physical order, 4 MiB reads, and the pages
+//                    are dropped afterwards so a long scan does not flush the cache
+//   NFS/SMB/FUSE     8 files in flight to hide network latency
+//   overlayfs        2 files in flight; the backing layers are unknown
+// Overrides given with -io-profile apply on top of every detected profile. No profile
+// uses mmap by default: a file truncated while mapped raises SIGBUS and ends the run,
+// so mmap (read=mmap) is only an explicit opt-in for trees nothing else writes to.
+// ------------------------------------------------------------------------------------
+class IoProfiles {
+public:
+    // Parses "key=value,..." overrides; returns false (with the bad setting) if invalid
+    bool setOverrides(const std::string& spec, std::string& bad) {
+        std::istringstream ss(spec);
+        std::string setting;
+        IoProfile check;
+        while (std::getline(ss, setting, ',')) {
+            size_t eq = setting.find('=');
+            if (eq == std::string::npos || !check.set(setting.substr(0, eq), setting.substr(eq + 1))) {
+                bad = setting;
+                return false;
+            }
+            overrides_.emplace_back(setting.substr(0, eq), setting.substr(eq + 1));
+        }
+        return true;
+    }
+
+    // Profile of the filesystem holding `path`, which lives on `device`
+    IoProfile forDevice(dev_t device, const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = profiles_.find(device);
+        if (it != profiles_.end())
+            return it->second;
+        IoProfile profile = detect(device, path);
+        for (const auto &[key, value] : overrides_)
+            profile.set(key, value);
+        profiles_[device] = profile;
+        return profile;
+    }
+
+private:
+    static IoProfile detect(dev_t device, const std::string& path) {
+        enum Kind { MEMORY, LOCAL, NETWORK, OVERLAY };
+        static const struct { uint32_t magic; const char *name; Kind kind; } filesystems[] = {
+            {0x01021994, "tmpfs", MEMORY},      {0x858458f6, "ramfs", MEMORY},
+            {0x0000EF53, "ext2/3/4", LOCAL},    {0x58465342, "xfs", LOCAL},
+            {0x9123683E, "btrfs", LOCAL},       {0xF2F52010, "f2fs", LOCAL},
+            {0x2FC12FC1, "zfs", LOCAL},         {0x00006969, "nfs", NETWORK},
+            {0xFF534D42, "cifs", NETWORK},      {0xFE534D42, "smb2", NETWORK},
+            {0x65735546, "fuse", NETWORK},      {0x794C7630, "overlayfs", OVERLAY},
+        };
+        IoProfile profile;
+        struct statfs fs;
+        if (statfs(path.c_str(), &fs) != 0)
+            return profile;
+        for (const auto &filesystem : filesystems) {
+            if ((uint32_t)fs.f_type != filesystem.magic)
+                continue;
+            profile.name = filesystem.name;
+            if (filesystem.kind == MEMORY) {
+                profile.queue_depth = (int)std::max(1u, std::thread::hardware_concurrency());
+                profile.advice = IoProfile::ADVICE_NONE;
+            } else if (filesystem.kind == LOCAL && isRotationalDevice(device)) {
+                profile.name += " on HDD";
+                profile.block_size = 4 * 1024 * 1024;
+                profile.physical_order = true;
+                profile.advice = IoProfile::ADVICE_NOREUSE;
+            } else if (filesystem.kind == LOCAL) {
+                profile.name += " on SSD";
+                profile.queue_depth = 4;
+            } else if (filesystem.kind == NETWORK) {
+                profile.queue_depth = 8;
+            } else {
+                profile.queue_depth = 2;
+            }
+            return profile;
+        }
+        std::ostringstream name;
+        name << "filesystem 0x" << std::hex << (uint32_t)fs.f_type;
+        profile.name = name.str();
+        profile.physical_order = isRotationalDevice(device);
+        return profile;
+    }
+
+    std::mutex mutex_;
+    std::map<dev_t, IoProfile> profiles_;
+    std::vector<std::pair<std::string, std::string>> overrides_;
+};
+
+IoProfiles ioProfiles;
+
+// ------------------------------------------------------------------------------------
+// Class: IoBackend
+// Where file contents come from. The default backend reads with pread; -simulate-io
+// installs a SimulatedIoBackend that wraps it.
+// ------------------------------------------------------------------------------------
+class IoBackend {
+public:
+    virtual ~IoBackend() = default;
+
+    // Reads like pread from an open file; `st` is the file's fstat result
+    virtual ssize_t read(int fd, const struct stat& st, void *buffer, size_t length, off_t offset) {
+        (void)st;
+        return pread(fd, buffer, length, offset);
+    }
+
+    // Whether readers may bypass read() with mmap
+    virtual bool allowsMmap() const { return true; }
+
+    virtual void report(std::ostream& out) const { (void)out; }
+};
+
+// ------------------------------------------------------------------------------------
+// Class: SimulatedIoBackend
+// Wraps the real reader and makes each device behave like configured storage, so that
+// ordering, per-device queues and throttling can be tested on any machine. Settings
+// (default for all devices, or per device with dev=<major>:<minor>):
+//   seek=<ms>    added when a read does not start where the last one on the device
+//                ended or up to 1 MiB after it (a gap that is read through); files
+//                are placed at their FIEMAP offset, else 1 GiB apart
+//   lat=<ms>     added to every read
+//   bw=<n>[K|M|G] bytes per second; transfers on one device take turns
+//   qd=<n>       reads the device serves at once; more wait for a free slot
+//   errors=<p>   fraction of reads that fail with EIO, chosen by a hash of device,
+//                inode, offset and seed=<n>, so a rerun fails the same reads
+// Delays are real sleeps; the report counts reads, seeks, bytes and errors per device.
+// ------------------------------------------------------------------------------------
+class SimulatedIoBackend : public IoBackend {
+public:
+    explicit SimulatedIoBackend(std::unique_ptr<IoBackend> inner) : inner_(std::move(inner)) {}
+
+    // A gap this small ahead of the last read is read through instead of seeking
+    static constexpr uint64_t READ_THROUGH_BYTES = 1024 * 1024;
+
+    // Parses one -simulate-io setting list; returns false (with the bad setting) if invalid
+    bool configure(const std::string& spec, std::string& bad) {
+        DeviceModel model = default_model_;
+        std::string device;
+        std::istringstream ss(spec);
+        std::string setting;
+        while (std::getline(ss, setting, ',')) {
+            size_t eq = setting.find('=');
+            std::string key = setting.substr(0, eq);
+            std::string value = eq == std::string::npos ? "" : setting.substr(eq + 1);
+            try {
+                if (key == "dev" && value.find(':') != std::string::npos) {
+                    device = value;
+                } else if (key == "seek") {
+                    model.seek = std::stod(value) / 1000;
+                } else if (key == "lat") {
+                    model.latency = std::stod(value) / 1000;
+                } else if (key == "bw") {
+                    double unit = 1;
+                    char suffix = value.empty() ? 0 : (char)toupper(value.back());
+                    if (suffix == 'K' || suffix == 'M' || suffix == 'G')
+                        unit = suffix == 'K' ? 1024.0 : suffix == 'M' ? 1024.0 * 1024 : 1024.0 * 1024 * 1024;
+                    model.bandwidth = std::stod(value) * unit;
+                } else if (key == "qd") {
+                    model.queue_depth = std::max(1, std::stoi(value));
+                } else if (key == "errors") {
+                    model.error_rate = std::stod(value);
+                } else if (key == "seed") {
+                    model.seed = std::stoull(value);
+                } else {
+                    bad = setting;
+                    return false;
+                }
+            } catch (const std::exception &e) {
+                bad = setting;
+                return false;
+            }
+        }
+        if (device.empty()) {
+            default_model_ = model;
+        } else {
+            size_t colon = device.find(':');
+            try {
+                models_[makedev(std::stoul(device.substr(0, colon)), std::stoul(device.substr(colon + 1)))] = model;
+            } catch (const std::exception &e) {
+                bad = "dev=" + device;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    ssize_t read(int fd, const struct stat& st, void *buffer, size_t length, off_t offset) override {
+        using namespace std::chrono;
+        Device &device = deviceFor(st.st_dev);
+        const DeviceModel &model = device.model;
+        uint64_t position = placement(fd, st) + (uint64_t)offset;
+
+        // Same device, inode, offset and seed: same verdict
+        if (model.error_rate > 0) {
+            uint64_t x = model.seed ^ ((uint64_t)st.st_dev << 48) ^ ((uint64_t)st.st_ino * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)offset;
+            x ^= x >> 30; x *= 0xBF58476D1CE4E5B9ULL;
+            x ^= x >> 27; x *= 0x94D049BB133111EBULL;
+            x ^= x >> 31;
+            if ((double)(x >> 11) / (double)(1ULL << 53) < model.error_rate) {
+                std::lock_guard<std::mutex> lock(device.mutex);
+                device.errors++;
+                errno = EIO;
+                return -1;
+            }
+        }
+
+        steady_clock::time_point done;
+        {
+            std::unique_lock<std::mutex> lock(device.mutex);
+            device.slot_free.wait(lock, [&] { return model.queue_depth == 0 || device.in_flight < model.queue_depth; });
+            device.in_flight++;
+            // A short skip forward is read through; anything else is a seek
+            bool read_through = position >= device.head && position - device.head <= READ_THROUGH_BYTES;
+            bool seek = !read_through;
+            uint64_t transferred = length + (read_through ? position - device.head : 0);
+            double seek_time = seek ? model.seek : 0;
+            auto now = steady_clock::now();
+            auto start = now + duration_cast<steady_clock::duration>(duration<double>(model.latency + seek_time));
+            if (model.bandwidth > 0) {
+                start = std::max(start, device.transfer_free);
+                device.transfer_free = start + duration_cast<steady_clock::duration>(
+                                                   duration<double>(transferred / model.bandwidth));
+                done = device.transfer_free;
+            } else {
+                done = start;
+            }
+            device.head = position + length;
+            device.reads++;
+            device.seeks += seek;
+            device.seek_time += seek_time;
+            device.bytes += length;
+            device.busy += duration<double>(done - now).count();
+        }
+        std::this_thread::sleep_until(done);
+        ssize_t got = inner_->read(fd, st, buffer, length, offset);
+        {
+            std::lock_guard<std::mutex> lock(device.mutex);
+            device.in_flight--;
+        }
+        device.slot_free.notify_one();
+        return got;
+    }
+
+    bool allowsMmap() const override { return false; }
+
+    void report(std::ostream& out) const override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto &[dev, device] : devices_) {
+            out << "Simulated I/O " << major(dev) << ":" << minor(dev) << ": " << device->reads << " reads, "
+                << device->seeks << " seeks (" << std::fixed << std::setprecision(2) << device->seek_time
+                << " s), " << formatBytes(device->bytes) << ", " << device->errors << " injected errors, "
+                << device->busy << " s waited" << std::defaultfloat << "\n";
+        }
+    }
+
+private:
+    struct DeviceModel {
+        double seek = 0;          // seconds
+        double latency = 0;       // seconds
+        double bandwidth = 0;     // bytes per second, 0 = unlimited
+        int queue_depth = 0;      // 0 = unlimited
+        double error_rate = 0;
+        uint64_t seed = 1;
+    };
+
+    struct Device {
+        DeviceModel model;
+        std::mutex mutex;
+        std::condition_variable slot_free;
+        int in_flight = 0;
+        uint64_t head = std::numeric_limits<uint64_t>::max();
+        std::chrono::steady_clock::time_point transfer_free;
+        uint64_t reads = 0;
+        uint64_t seeks = 0;
+        uint64_t bytes = 0;
+        uint64_t errors = 0;
+        double seek_time = 0;
+        double busy = 0;
+    };
+
+    Device& deviceFor(dev_t dev) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &device = devices_[dev];
+        if (!device) {
+            device = std::make_unique<Device>();
+            auto it = models_.find(dev);
+            device->model = it != models_.end() ? it->second : default_model_;
+        }
+        return *device;
+    }
+
+    // Where the file starts on the simulated platter
+    uint64_t placement(int fd, const struct stat& st) {
+        std::pair<dev_t, ino_t> key(st.st_dev, st.st_ino);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = placements_.find(key);
+            if (it != placements_.end())
+                return it->second;
+        }
+        uint64_t physical = physicalOffset(fd);
+        if (physical == 0)
+            physical = (uint64_t)st.st_ino << 30;
+        std::lock_guard<std::mutex> lock(mutex_);
+        placements_[key] = physical;
+        return physical;
+    }
+
+    std::unique_ptr<IoBackend> inner_;
+    DeviceModel default_model_;
+    std::map<dev_t, DeviceModel> models_;
+    mutable std::mutex mutex_;
+    std::map<dev_t, std::unique_ptr<Device>> devices_;
+    std::map<std::pair<dev_t, ino_t>, uint64_t> placements_;
+};
+
+std::unique_ptr<IoBackend> ioBackend = std::make_unique<IoBackend>();
+
+// ------------------------------------------------------------------------------------
+// Function: digestKey
+// The first 64 bits of a raw (binary) digest
+// ------------------------------------------------------------------------------------
+uint64_t digestKey(const std::string& raw) {
+    uint64_t key = 0;
+    for (size_t i = 0; i < sizeof(uint64_t) && i < raw.size(); i++)
+        key = (key << 8) | (unsigned char)raw[i];
+    return key;
+}
+
+// ------------------------------------------------------------------------------------
+// Struct: PrefixCheckpoint
+// -prefix-copies: 64-bit key of the digest of a file's first `offset` bytes
+// ------------------------------------------------------------------------------------
+struct PrefixCheckpoint {
+    uint64_t offset = 0;
+    uint64_t key = 0;
+    bool taken = false;  // false if the file ended before the offset, or reading failed
+};
+
+// ------------------------------------------------------------------------------------
+// Function: getHash
+// Calculates the hash of a file based on the given algorithm (MD5 or SHA-256), read
+// through the I/O backend as the I/O profile of its filesystem says. With `checkpoints`
+// (sorted by offset), the 64-bit key of the digest so far is also saved at each of
+// their offsets inside the file during the same read.
+// ------------------------------------------------------------------------------------
+std::string getHash(const std::string& filepath, const std::string& algorithm = "MD5",
+                    std::vector<PrefixCheckpoint>* checkpoints = nullptr) {
+    std::string output;
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        errorLog.add("Cannot open file", filepath, std::strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return "";
+    }
+    IoProfile profile = ioProfiles.forDevice(st.st_dev, filepath);
+    if (profile.advice != IoProfile::ADVICE_NONE)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // Only offsets inside the file (as fstat sees it) are taken
+    size_t next = 0, inside = 0;
+    if (checkpoints) {
+        for (auto &checkpoint : *checkpoints) {
+            checkpoint.taken = false;
+            if (checkpoint.offset > 0 && checkpoint.offset < (uint64_t)st.st_size)
+                inside++;
+        }
+    }
+    try {
+        auto hash = createHashFunction(algorithm);
+        std::string digest(hash->DigestSize(), '\0');
+        uint64_t offset = 0;
+        // Feeds the hash, stopping on each checkpoint offset
+        auto consume = [&](const char *data, size_t length) {
+            while (length > 0) {
+                size_t take = length;
+                if (next < inside && (*checkpoints)[next].offset - offset < take)
+                    take = (size_t)((*checkpoints)[next].offset - offset);
+                hash->Update(reinterpret_cast<const CryptoPP::byte*>(data), take);
+                offset += take;
+                data += take;
+                length -= take;
+                if (next < inside && offset == (*checkpoints)[next].offset) {
+                    std::unique_ptr<CryptoPP::HashTransformation> partial(
+                        dynamic_cast<CryptoPP::HashTransformation*>(hash->Clone()));
+                    partial->Final(reinterpret_cast<CryptoPP::byte*>(&digest[0]));
+                    (*checkpoints)[next].key = digestKey(digest);
+                    (*checkpoints)[next].taken = true;
+                    next++;
+                }
+            }
+        };
+
+        void *map = MAP_FAILED;
+        if (profile.use_mmap && ioBackend->allowsMmap() && st.st_size > 0)
+            map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            const char *data = static_cast<const char*>(map);
+            for (uint64_t pos = 0; pos < (uint64_t)st.st_size; pos += profile.block_size)
+                consume(data + pos, (size_t)std::min<uint64_t>(profile.block_size, st.st_size - pos));
+            munmap(map, (size_t)st.st_size);
+        } else {
+            std::vector<char> buffer(std::min<uint64_t>(profile.block_size, std::max<uint64_t>(st.st_size, 4096)));
+            // Stops at the size seen by fstat; growth shows up in the caller's fingerprint check
+            ssize_t got = 0;
+            while (offset < (uint64_t)st.st_size &&
+                   (got = ioBackend->read(fd, st, buffer.data(), buffer.size(), (off_t)offset)) > 0)
+                consume(buffer.data(), (size_t)got);
+            if (got < 0)
+                throw std::runtime_error(std::strerror(errno));
+        }
+        hash->Final(reinterpret_cast<CryptoPP::byte*>(&digest[0]));
+        CryptoPP::HexEncoder encoder(new CryptoPP::StringSink(output));
+        encoder.Put(reinterpret_cast<const CryptoPP::byte*>(digest.data()), digest.size());
+        encoder.MessageEnd();
+    } catch (const std::exception &e) {
+        errorLog.add("Hash error for file", filepath, e.what());
+        output.clear();
+        if (checkpoints) {
+            for (auto &checkpoint : *checkpoints)
+                checkpoint.taken = false;
+        }
+    }
+    if (profile.advice == IoProfile::ADVICE_NOREUSE)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return output;
+}
+
+// ------------------------------------------------------------------------------------
+// Class: ByteStream
+// Minimal sequential byte source used by the archive readers
+// ------------------------------------------------------------------------------------
+class ByteStream {
+public:
+    virtual ~ByteStream() = default;
+    virtual size_t read(char *buf, size_t n) = 0;
+
+    void readExact(char *buf, size_t n) {
+        size_t got = 0;
+        while (got < n) {
+            size_t r = read(buf + got, n - got);
+            if (r == 0)
+                throw std::runtime_error("unexpected end of archive");
+            got += r;
+        }
+    }
+
+    void skip(uint64_t n) {
+        char buf[65536];
+        while (n > 0) {
+            size_t r = read(buf, (size_t)std::min<uint64_t>(n, sizeof(buf)));
+            if (r == 0)
+                throw std::runtime_error("unexpected end of archive");
+            n -= r;
+        }
+    }
+};
+
+// ------------------------------------------------------------------------------------
+// Class: HashingFileStream
+// Reads an archive file front to back and feeds every byte into the digest of the
+// archive itself, so the archive and its members are hashed in a single read
+// ------------------------------------------------------------------------------------
+class HashingFileStream : public ByteStream {
+public:
+    HashingFileStream(std::istream& in, CryptoPP::BufferedTransformation& digest)
+        : in_(in), digest_(digest) {}
+
+    size_t read(char *buf, size_t n) override {
+        in_.read(buf, n);
+        size_t got = (size_t)in_.gcount();
+        digest_.Put(reinterpret_cast<const CryptoPP::byte*>(buf), got);
+        offset_ += got;
+        return got;
+    }
+
+    uint64_t offset() const { return offset_; }
+
+    void drain() {
+        char buf[65536];
+        while (read(buf, sizeof(buf)) > 0) {}
+    }
+
+private:
+    std::istream& in_;
+    CryptoPP::BufferedTransformation& digest_;
+    uint64_t offset_ = 0;
+};
+
+// ------------------------------------------------------------------------------------
+// Class: GunzipByteStream
+// Decompresses a gzip stream on the fly, without writing anything to disk
+// ------------------------------------------------------------------------------------
+class GunzipByteStream : public ByteStream {
+public:
+    explicit GunzipByteStream(ByteStream& source) : source_(source) {}
+
+    size_t read(char *buf, size_t n) override {
+        while (gunzip_.MaxRetrievable() == 0 && !finished_) {
+            char in[65536];
+            size_t got = source_.read(in, sizeof(in));
+            if (got == 0) {
+                gunzip_.MessageEnd();
+                finished_ = true;
+            } else {
+                gunzip_.Put(reinterpret_cast<const CryptoPP::byte*>(in), got);
+            }
+        }
+        return gunzip_.Get(reinterpret_cast<CryptoPP::byte*>(buf), n);
+    }
+
+private:
+    ByteStream& source_;
+    CryptoPP::Gunzip gunzip_;
+    bool finished_ = false;
+};
+
+struct ArchiveMember {
+    std::string name;
+    uint64_t size;
+    std::string hash;
+};
+
+// ------------------------------------------------------------------------------------
+// Function: isSupportedArchive
+// Checks whether the file is an archive whose members can be hashed (zip, tar, tar.gz)
+// ------------------------------------------------------------------------------------
+bool isSupportedArchive(const std::string& path) {
+    auto endsWith = [&](const std::string& suffix) {
+        return path.size() >= suffix.size() &&
+               std::equal(suffix.rbegin(), suffix.rend(), path.rbegin(),
+                          [](char a, char b) { return a == std::tolower((unsigned char)b); });
+    };
+    return endsWith(".zip") || endsWith(".tar") || endsWith(".tar.gz") || endsWith(".tgz");
+}
+
+// ------------------------------------------------------------------------------------
+// Function: hashArchiveMember
+// Streams size bytes of a member through an optional inflater into a hex digest
+// ------------------------------------------------------------------------------------
+std::string hashArchiveMember(ByteStream& in, uint64_t size, const std::string& algorithm, bool deflated) {
+    std::string output;
+    auto hash = createHashFunction(algorithm);
+    CryptoPP::BufferedTransformation *filter = new CryptoPP::HashFilter(*hash,
+        new CryptoPP::HexEncoder(new CryptoPP::StringSink(output)));
+    std::unique_ptr<CryptoPP::BufferedTransformation> pipeline(
+        deflated ? new CryptoPP::Inflator(filter) : filter);
+    char buf[65536];
+    while (size > 0) {
+        size_t r = in.read(buf, (size_t)std::min<uint64_t>(size, sizeof(buf)));
+        if (r == 0)
+            throw std::runtime_error("unexpected end of archive");
+        pipeline->Put(reinterpret_cast<const CryptoPP::byte*>(buf), r);
+        size -= r;
+    }
+    pipeline->MessageEnd();
+    return output;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: parseTarNumber
+// Parses a numeric tar header field (octal, or base-256 for large values)
+// ------------------------------------------------------------------------------------
+uint64_t parseTarNumber(const char *field, size_t len) {
+    uint64_t value = 0;
+    if ((unsigned char)field[0] & 0x80) {
+        for (size_t i = 1; i < len; i++)
+            value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+    for (size_t i = 0; i < len && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7')
+            value = (value << 3) | (uint64_t)(field[i] - '0');
+    }
+    return value;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: scanTarMembers
+// Hashes every regular file in a tar stream (ustar, GNU long names and pax paths)
+// ------------------------------------------------------------------------------------
+void scanTarMembers(ByteStream& in, const std::string& algorithm, std::vector<ArchiveMember>& members) {
+    std::string long_name;
+    char header[512];
+    while (true) {
+        in.readExact(header, sizeof(header));
+        if (std::all_of(header, header + sizeof(header), [](char c) { return c == 0; }))
+            break;
+
+        unsigned int checksum = 0;
+        for (size_t i = 0; i < sizeof(header); i++)
+            checksum += (i >= 148 && i < 156) ? ' ' : (unsigned char)header[i];
+        if (checksum != parseTarNumber(header + 148, 8))
+            throw std::runtime_error("invalid tar header");
+
+        uint64_t size = parseTarNumber(header + 124, 12);
+        uint64_t padding = (512 - size % 512) % 512;
+        char type = header[156];
+
+        if (type == 'L' || type == 'x') {
+            std::string data(size, '\0');
+            in.readExact(&data[0], size);
+            in.skip(padding);
+            if (type == 'L') {
+                long_name = data.c_str();
+            } else {
+                // pax records: "<length> <key>=<value>\n"
+                size_t pos = 0;
+                while (pos < data.size()) {
+                    size_t space = data.find(' ', pos);
+                    if (space == std::string::npos)
+                        break;
+                    size_t record_len = std::strtoull(data.c_str() + pos, nullptr, 10);
+                    if (record_len == 0)
+                        break;
+                    std::string record = data.substr(space + 1, pos + record_len - space - 2);
+                    if (record.compare(0, 5, "path=") == 0)
+                        long_name = record.substr(5);
+                    pos += record_len;
+                }
+            }
+            continue;
+        }
+
+        std::string name = long_name;
+        long_name.clear();
+        if (name.empty()) {
+            name.assign(header, strnlen(header, 100));
+            if (std::memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+                name = std::string(header + 345, strnlen(header + 345, 155)) + "/" + name;
+            }
+        }
+
+        if (name.compare(0, 2, "./") == 0)
+            name.erase(0, 2);
+        if (type == '0' || type == '\0' || type == '7') {
+            members.push_back({name, size, hashArchiveMember(in, size, algorithm, false)});
+        } else {
+            in.skip(size);
+        }
+        in.skip(padding);
+    }
+}
+
+// ------------------------------------------------------------------------------------
+// Function: readLE
+// Reads a little-endian integer of the given width from a zip header
+// ------------------------------------------------------------------------------------
+uint64_t readLE(const char *p, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        value = (value << 8) | (unsigned char)p[i];
+    return value;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: scanZipMembers
+// Hashes every stored or deflated member of a zip archive. The central directory at
+// the end of the file supplies member sizes, then the members are read in file order.
+// ------------------------------------------------------------------------------------
+void scanZipMembers(std::istream& file, HashingFileStream& in, const std::string& algorithm,
+                    std::vector<ArchiveMember>& members) {
+    struct ZipEntry {
+        std::string name;
+        uint64_t local_offset;
+        uint64_t compressed_size;
+        uint64_t size;
+        int method;
+    };
+
+    // Locate the end of central directory record in the tail of the file
+    file.seekg(0, std::ios::end);
+    uint64_t file_size = (uint64_t)file.tellg();
+    uint64_t tail_size = std::min<uint64_t>(file_size, 65535 + 22);
+    std::string tail(tail_size, '\0');
+    file.seekg(file_size - tail_size);
+    file.read(&tail[0], tail_size);
+    size_t eocd = std::string::npos;
+    for (size_t i = tail_size >= 22 ? tail_size - 22 + 1 : 0; i-- > 0;) {
+        if (readLE(&tail[i], 4) == 0x06054b50) {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd == std::string::npos)
+        throw std::runtime_error("zip end of central directory not found");
+    uint64_t entry_count = readLE(&tail[eocd + 10], 2);
+    uint64_t cd_size = readLE(&tail[eocd + 12], 4);
+    uint64_t cd_offset = readLE(&tail[eocd + 16], 4);
+    if (cd_offset == 0xFFFFFFFF || entry_count == 0xFFFF)
+        throw std::runtime_error("ZIP64 archives are not supported");
+
+    std::string cd(cd_size, '\0');
+    file.seekg(cd_offset);
+    file.read(&cd[0], cd_size);
+    if ((uint64_t)file.gcount() != cd_size)
+        throw std::runtime_error("truncated zip central directory");
+
+    std::vector<ZipEntry> entries;
+    size_t pos = 0;
+    for (uint64_t i = 0; i < entry_count; i++) {
+        if (pos + 46 > cd.size() || readLE(&cd[pos], 4) != 0x02014b50)
+            throw std::runtime_error("invalid zip central directory");
+        uint64_t flags = readLE(&cd[pos + 8], 2);
+        int method = (int)readLE(&cd[pos + 10], 2);
+        uint64_t compressed_size = readLE(&cd[pos + 20], 4);
+        uint64_t size = readLE(&cd[pos + 24], 4);
+        size_t name_len = readLE(&cd[pos + 28], 2);
+        size_t extra_len = readLE(&cd[pos + 30], 2);
+        size_t comment_len = readLE(&cd[pos + 32], 2);
+        uint64_t local_offset = readLE(&cd[pos + 42], 4);
+        if (pos + 46 + name_len > cd.size())
+            throw std::runtime_error("invalid zip central directory");
+        std::string name = cd.substr(pos + 46, name_len);
+        pos += 46 + name_len + extra_len + comment_len;
+
+        // Skip directories, encrypted members and compression methods we cannot stream
+        bool encrypted = flags & 0x1;
+        if (name.empty() || name.back() == '/' || encrypted || (method != 0 && method != 8))
+            continue;
+        entries.push_back({name, local_offset, compressed_size, size, method});
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const ZipEntry &a, const ZipEntry &b) { return a.local_offset < b.local_offset; });
+
+    // Single forward pass over the member data
+    file.clear();
+    file.seekg(0);
+    for (const auto &entry : entries) {
+        if (entry.local_offset < in.offset())
+            throw std::runtime_error("overlapping zip members");
+        in.skip(entry.local_offset - in.offset());
+        char local[30];
+        in.readExact(local, sizeof(local));
+        if (readLE(local, 4) != 0x04034b50)
+            throw std::runtime_error("invalid zip local header");
+        in.skip(readLE(local + 26, 2) + readLE(local + 28, 2));
+        members.push_back({entry.name, entry.size,
+                           hashArchiveMember(in, entry.compressed_size, algorithm, entry.method == 8)});
+    }
+}
+
+// ------------------------------------------------------------------------------------
+// Function: scanArchive
+// Hashes an archive and all of its members in one read, without extracting anything.
+// Returns the hash of the archive file itself; throws on malformed archives.
+// ------------------------------------------------------------------------------------
+std::string scanArchive(const std::string& path, const std::string& algorithm,
+                        std::vector<ArchiveMember>& members) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("cannot open file");
+
+    std::string output;
+    auto hash = createHashFunction(algorithm);
+    CryptoPP::HashFilter digest(*hash, new CryptoPP::HexEncoder(new CryptoPP::StringSink(output)));
+    HashingFileStream in(file, digest);
+
+    std::string lower = path;
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (lower.size() >= 4 && lower.compare(lower.size() - 4, 4, ".zip") == 0) {
+        scanZipMembers(file, in, algorithm, members);
+    } else if (lower.size() >= 4 && lower.compare(lower.size() - 4, 4, ".tar") == 0) {
+        scanTarMembers(in, algorithm, members);
+    } else {
+        GunzipByteStream gunzip(in);
+        scanTarMembers(gunzip, algorithm, members);
+    }
+    in.drain();
+    digest.MessageEnd();
+    return output;
+}
+
+// ------------------------------------------------------------------------------------
+// Struct: FileFingerprint
+// Stat fields that change whenever a file's content is modified or replaced
+// ------------------------------------------------------------------------------------
+struct FileFingerprint {
+    dev_t device = 0;
+    ino_t inode = 0;
+    off_t size = 0;
+    struct timespec mtime = {};
+    struct timespec ctime = {};
+
+    bool operator==(const FileFingerprint &other) const {
+        return device == other.device && inode == other.inode && size == other.size &&
+               mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec &&
+               ctime.tv_sec == other.ctime.tv_sec && ctime.tv_nsec == other.ctime.tv_nsec;
+    }
+    bool operator!=(const FileFingerprint &other) const { return !(*this == other); }
+};
+
+// ------------------------------------------------------------------------------------
+// Function: getFingerprint
+// Captures the stat fingerprint of a file; returns false if the file cannot be stat'ed.
+// Symlinks are not followed, so a file replaced by a link no longer matches.
+// ------------------------------------------------------------------------------------
+bool getFingerprint(const std::string& path, FileFingerprint& fingerprint) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0)
+        return false;
+    fingerprint.device = st.st_dev;
+    fingerprint.inode = st.st_ino;
+    fingerprint.size = st.st_size;
+    fingerprint.mtime = st.st_mtim;
+    fingerprint.ctime = st.st_ctim;
+    return true;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: hashStableFile
+// Hashes a file (and, for supported archives, its members) between two stat calls.
+// Returns false if the file changed while it was read, so the caller can re-queue it;
+// hash stays empty if the file could not be hashed at all. Prefix checkpoints are
+// collected if requested (not for archives).
+// ------------------------------------------------------------------------------------
+bool hashStableFile(const std::string& path, const std::string& algorithm, bool scan_archives,
+                    std::string& hash, std::vector<ArchiveMember>& members, FileFingerprint& fingerprint,
+                    std::vector<PrefixCheckpoint>* checkpoints = nullptr) {
+    hash.clear();
+    members.clear();
+    if (!getFingerprint(path, fingerprint)) {
+        errorLog.add("Cannot stat file", path, std::strerror(errno));
+        return true;
+    }
+    if (scan_archives && isSupportedArchive(path)) {
+        try {
+            hash = scanArchive(path, algorithm, members);
+        } catch (const std::exception &e) {
+            errorLog.add("Archive error for file", path, e.what());
+            members.clear();
+            hash = getHash(path, algorithm);
+        }
+    } else {
+        hash = getHash(path, algorithm, checkpoints);
+    }
+    FileFingerprint after;
+    if (!getFingerprint(path, after)) {
+        // The file vanished while being read: nothing left to index
+        hash.clear();
+        members.clear();
+        return true;
+    }
+    return after == fingerprint;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: isUnchanged
+// Re-checks a file against the fingerprint recorded when it was hashed
+// ------------------------------------------------------------------------------------
+bool isUnchanged(const std::string& path, const std::unordered_map<std::string, FileFingerprint>& fingerprints) {
+    auto it = fingerprints.find(path);
+    FileFingerprint current;
+    return it != fingerprints.end() && getFingerprint(path, current) && current == it->second;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: isSameFile
+// True if two paths name the same file (device and inode, as recorded when hashed),
+// e.g. hard links: deleting one of them never frees the other's data
+// ------------------------------------------------------------------------------------
+bool isSameFile(const std::string& a, const std::string& b,
+                const std::unordered_map<std::string, FileFingerprint>& fingerprints) {
+    if (a == b)
+        return true;
+    auto it_a = fingerprints.find(a);
+    auto it_b = fingerprints.find(b);
+    return it_a != fingerprints.end() && it_b != fingerprints.end() &&
+           it_a->second.device == it_b->second.device && it_a->second.inode == it_b->second.inode;
+}
+
+// ------------------------------------------------------------------------------------
+// Class: Quarantine
+// Stall-free removal for -quarantine. A duplicate is renamed into a quarantine
+// directory on its own filesystem, which is instant, and a background purger then
+// shrinks it with ftruncate in PURGE_STEP_BYTES steps, pausing in between, before the
+// final unlink. That way a huge file never frees all its extents in one journal
+// transaction. The quarantine directory sits in the topmost directory of the scan
+// root that is still on the file's filesystem; leftovers from an interrupted run are
+// purged as soon as the directory is used again. Files with other hard links are
+// only unlinked, never truncated.
+// ------------------------------------------------------------------------------------
+class Quarantine {
+public:
+    ~Quarantine() { finish(); }
+
+    void enable(const std::vector<std::string>& roots) {
+        for (const auto &root : roots) {
+            std::error_code ec;
+            std::filesystem::path canonical_root = std::filesystem::canonical(root, ec);
+            if (!ec)
+                roots_.push_back(canonical_root);
+        }
+        enabled_ = true;
+    }
+
+    bool enabled() const { return enabled_; }
+
+    // Moves the file into quarantine and queues it. Returns false if the rename failed;
+    // the error is in `error` (EXDEV for e.g. a bind mount the climb could not see).
+    bool move(const std::string& file, std::string& target, int& error) {
+        struct stat st;
+        if (lstat(file.c_str(), &st) != 0) {
+            error = errno;
+            return false;
+        }
+        std::string directory = directoryFor(file, st.st_dev);
+        if (directory.empty()) {
+            error = errno;
+            return false;
+        }
+        target = directory + "/" + std::to_string(st.st_ino) + "-" +
+                 std::filesystem::path(file).filename().string();
+        if (rename(file.c_str(), target.c_str()) != 0) {
+            error = errno;
+            return false;
+        }
+        enqueue(target, (uint64_t)st.st_size);
+        return true;
+    }
+
+    // Waits until every queued file is purged, reports purge errors and removes the
+    // emptied quarantine directories
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closing_ = true;
+        }
+        ready_.notify_all();
+        if (worker_.joinable())
+            worker_.join();
+        for (const auto &failure : failures_)
+            errorLog.add("Failed to purge", failure.first, failure.second);
+        failures_.clear();
+        for (const auto &directory : directories_)
+            rmdir(directory.c_str());  // only succeeds once the directory is empty
+    }
+
+    void report(std::ostream& out) const {
+        if (!enabled_)
+            return;
+        out << "Purge backlog: " << backlog_files_ << " files, " << formatBytes(backlog_bytes_)
+            << " (" << purged_files_ << " files, " << formatBytes(purged_bytes_) << " purged so far)\n";
+    }
+
+private:
+    std::string directoryFor(const std::string& file, dev_t device) {
+        std::filesystem::path parent = std::filesystem::path(file).parent_path();
+        std::filesystem::path top = parent;
+        for (const auto &root : roots_) {
+            if (std::mismatch(root.begin(), root.end(), parent.begin(), parent.end()).first != root.end())
+                continue;
+            // Climb towards the root while staying on the same filesystem
+            top = parent;
+            while (top != root) {
+                struct stat st;
+                if (stat(top.parent_path().c_str(), &st) != 0 || st.st_dev != device)
+                    break;
+                top = top.parent_path();
+            }
+            break;
+        }
+        std::string directory = (top / QUARANTINE_DIR_NAME).string();
+        if (directories_.insert(directory).second) {
+            if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST) {
+                directories_.erase(directory);
+                return "";
+            }
+            // Resume what an earlier, interrupted run left behind
+            std::error_code ec;
+            for (std::filesystem::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+                struct stat st;
+                if (lstat(it->path().c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                    enqueue(it->path().string(), (uint64_t)st.st_size);
+            }
+        }
+        return directory;
+    }
+
+    void enqueue(const std::string& path, uint64_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.emplace_back(path, size);
+            backlog_files_++;
+            backlog_bytes_ += size;
+            if (!worker_.joinable())
+                worker_ = std::thread(&Quarantine::purge, this);
+        }
+        ready_.notify_one();
+    }
+
+    void purge() {
+        while (true) {
+            std::pair<std::string, uint64_t> entry;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return closing_ || !queue_.empty(); });
+                if (queue_.empty())
+                    return;
+                entry = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            purgeFile(entry.first, entry.second);
+        }
+    }
+
+    void purgeFile(const std::string& path, uint64_t queued_size) {
+        uint64_t remaining = queued_size;
+        int fd = open(path.c_str(), O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1) {
+            off_t size = st.st_size;
+            while (size > PURGE_STEP_BYTES) {
+                size -= PURGE_STEP_BYTES;
+                if (ftruncate(fd, size) != 0) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    failures_.emplace_back(path, std::strerror(errno));
+                    break;
+                }
+                uint64_t freed = std::min<uint64_t>(remaining, PURGE_STEP_BYTES);
+                remaining -= freed;
+                backlog_bytes_ -= freed;
+                purged_bytes_ += freed;
+                std::this_thread::sleep_for(std::chrono::milliseconds(PURGE_STEP_PAUSE_MS));
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+        if (unlink(path.c_str()) != 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            failures_.emplace_back(path, std::strerror(errno));
+        } else {
+            purged_files_++;
+        }
+        backlog_files_--;
+        backlog_bytes_ -= remaining;
+        purged_bytes_ += remaining;
+    }
+
+    bool enabled_ = false;
+    std::vector<std::filesystem::path> roots_;
+    std::set<std::string> directories_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::pair<std::string, uint64_t>> queue_;
+    std::vector<std::pair<std::string, std::string>> failures_;
+    bool closing_ = false;
+    std::thread worker_;
+    std::atomic<uint64_t> backlog_files_{0};
+    std::atomic<uint64_t> backlog_bytes_{0};
+    std::atomic<uint64_t> purged_files_{0};
+    std::atomic<uint64_t> purged_bytes_{0};
+};
+
+Quarantine quarantine;
+
+// ------------------------------------------------------------------------------------
+// Function: removeDuplicate
+// Deletes one duplicate, or with -quarantine moves it to the purger (or only logs it in
+// a DRY run). Returns true if it was deleted.
+// ------------------------------------------------------------------------------------
+bool removeDuplicate(const std::string& file, const std::string& hash, const std::string& duplicates,
+                     bool dry_run, std::ofstream& logFile) {
+    if (dry_run) {
+        logFile << (quarantine.enabled() ? "DRY run: Would quarantine " : "DRY run: Would delete ") << file 
+                << " (Hash: " << hash 
+                << ", Duplicates: " << duplicates << ")\n";
+        return false;
+    }
+    if (quarantine.enabled()) {
+        std::string target;
+        int error = 0;
+        if (quarantine.move(file, target, error)) {
+            logFile << "Quarantined " << file << " as " << target
+                    << " (Hash: " << hash
+                    << ", Duplicates: " << duplicates << ")\n";
+            return true;
+        }
+        if (error != EXDEV) {
+            errorLog.add("Failed to quarantine", file, std::strerror(error));
+            return false;
+        }
+    }
+    try {
+        std::filesystem::remove(file);
+        logFile << "Deleted " << file 
+                << " (Hash: " << hash 
+                << ", Duplicates: " << duplicates << ")\n";
+        return true;
+    } catch (const std::filesystem::filesystem_error &e) {
+        errorLog.add("Failed to delete", file, e.what());
+        return false;
+    }
+}
+
+// ------------------------------------------------------------------------------------
+// Struct: RecordDigests
+// The variable-size hashing state of a FileRecord, kept out of the record and
+// allocated only while it holds something
+// ------------------------------------------------------------------------------------
+struct RecordDigests {
+    std::string hash;
+    std::string partial_hash;  // "H:<hex>" (head) or "HT:<hex>" (head and tail), if probed
+    std::vector<PrefixCheckpoint> checkpoints;  // -prefix-copies, planned by planPrefixCheckpoints
+};
+
+// ------------------------------------------------------------------------------------
+// Struct: FileRecord
+// One indexed file: its path, stat fingerprint and, once computed, its hash. The hash,
+// partial hash and prefix checkpoints live in a RecordDigests block behind one pointer,
+// so a record that has none of them in memory (never hashed, or compacted into the
+// side file) holds only its path, fingerprint, key and slot.
+// ------------------------------------------------------------------------------------
+struct FileRecord {
+    std::string path;
+    FileFingerprint fingerprint;
+    uint64_t digest_key = 0;   // compact index: first 64 bits of the digest
+    uint32_t digest_slot = NO_DIGEST_SLOT;  // compact index: digest position in the side file
+    bool archive_member = false;
+
+    FileRecord() = default;
+    FileRecord(FileRecord&&) = default;
+    FileRecord& operator=(FileRecord&&) = default;
+    FileRecord(const FileRecord& other)
+        : path(other.path), fingerprint(other.fingerprint), digest_key(other.digest_key),
+          digest_slot(other.digest_slot), archive_member(other.archive_member),
+          digests_(other.digests_ ? std::make_unique<RecordDigests>(*other.digests_) : nullptr) {}
+    FileRecord& operator=(const FileRecord& other) {
+        FileRecord copy(other);
+        return *this = std::move(copy);
+    }
+
+    // Read access; empty when not in memory
+    const std::string& hash() const { return digests_ ? digests_->hash : none().hash; }
+    const std::string& partialHash() const { return digests_ ? digests_->partial_hash : none().partial_hash; }
+    const std::vector<PrefixCheckpoint>& checkpoints() const {
+        return digests_ ? digests_->checkpoints : none().checkpoints;
+    }
+
+    // Write access; allocates the block on first use
+    RecordDigests& digests() {
+        if (!digests_)
+            digests_ = std::make_unique<RecordDigests>();
+        return *digests_;
+    }
+
+    // Frees the block once nothing is left in it
+    void trimDigests() {
+        if (digests_ && digests_->hash.empty() && digests_->partial_hash.empty() && digests_->checkpoints.empty())
+            digests_.reset();
+    }
+
+    bool hasDigest() const { return !hash().empty() || digest_slot != NO_DIGEST_SLOT; }
+
+private:
+    static const RecordDigests& none() {
+        static const RecordDigests empty;
+        return empty;
+    }
+
+    std::unique_ptr<RecordDigests> digests_;
+};
+
+// ------------------------------------------------------------------------------------
+// Class: DigestStore
+// Compact fingerprint index. When enabled, a record's hex digest is moved to an
+// append-only side file of fixed-size raw digests and only a 64-bit key and the slot
+// stay in memory. Full digests are read back only for groups whose keys match.
+// The side file is removed when the run ends.
+// ------------------------------------------------------------------------------------
+class DigestStore {
+public:
+    ~DigestStore() {
+        if (enabled()) {
+            file_.close();
+            std::remove(path_.c_str());
+        }
+    }
+
+    bool open(const std::string& path) {
+        path_ = path;
+        file_.open(path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+        return file_.is_open();
+    }
+
+    bool enabled() const { return file_.is_open(); }
+
+    // Moves the record's digest into the side file (keeps it in memory if that fails)
+    void compact(FileRecord& record) {
+        if (!enabled() || record.hash().empty() || next_slot_ == NO_DIGEST_SLOT)
+            return;
+        std::string raw;
+        CryptoPP::HexDecoder decoder(new CryptoPP::StringSink(raw));
+        decoder.Put(reinterpret_cast<const CryptoPP::byte*>(record.hash().data()), record.hash().size());
+        decoder.MessageEnd();
+        if (digest_size_ == 0)
+            digest_size_ = raw.size();
+        if (raw.size() != digest_size_ || raw.size() < sizeof(uint64_t))
+            return;
+        file_.seekp(0, std::ios::end);
+        file_.write(raw.data(), raw.size());
+        if (!file_) {
+            file_.clear();
+            return;
+        }
+        record.digest_key = digestKey(raw);
+        record.digest_slot = next_slot_++;
+        std::string().swap(record.digests().hash);
+        record.trimDigests();
+    }
+
+    // Returns the record's full hex digest, reading it from the side file if needed
+    std::string digest(const FileRecord& record) {
+        if (record.digest_slot == NO_DIGEST_SLOT)
+            return record.hash();
+        std::string raw(digest_size_, '\0');
+        file_.seekg((uint64_t)record.digest_slot * digest_size_);
+        file_.read(&raw[0], digest_size_);
+        std::string hex;
+        CryptoPP::HexEncoder encoder(new CryptoPP::StringSink(hex));
+        encoder.Put(reinterpret_cast<const CryptoPP::byte*>(raw.data()), raw.size());
+        encoder.MessageEnd();
+        return hex;
+    }
+
+private:
+    std::string path_;
+    std::fstream file_;
+    size_t digest_size_ = 0;
+    uint32_t next_slot_ = 0;
+};
+
+struct DuplicateGroup {
+    std::string hash;
+    std::vector<size_t> ids;
+};
+
+// ------------------------------------------------------------------------------------
+// Function: buildDuplicateGroups
+// Groups hashed records (by index) with equal content. With the compact index they
+// are grouped by size and 64-bit key, and only those groups have their full digests
+// read back, which also splits the rare key collision.
+// ------------------------------------------------------------------------------------
+std::vector<DuplicateGroup> buildDuplicateGroups(const std::vector<FileRecord>& records, DigestStore& digests) {
+    std::vector<size_t> ids;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (records[i].hasDigest())
+            ids.push_back(i);
+    }
+    auto less = [&](size_t a, size_t b) {
+        const FileRecord &ra = records[a], &rb = records[b];
+        if (ra.fingerprint.size != rb.fingerprint.size)
+            return ra.fingerprint.size < rb.fingerprint.size;
+        if (ra.digest_key != rb.digest_key)
+            return ra.digest_key < rb.digest_key;
+        return ra.hash() < rb.hash();
+    };
+    std::sort(ids.begin(), ids.end(), less);
+
+    std::vector<DuplicateGroup> groups;
+    for (size_t i = 0; i < ids.size();) {
+        size_t j = i + 1;
+        while (j < ids.size() && !less(ids[i], ids[j]))
+            j++;
+        if (j - i > 1) {
+            std::map<std::string, std::vector<size_t>> by_digest;
+            for (size_t k = i; k < j; k++)
+                by_digest[digests.digest(records[ids[k]])].push_back(ids[k]);
+            for (auto &[hash, members] : by_digest) {
+                if (members.size() > 1)
+                    groups.push_back({hash, std::move(members)});
+            }
+        }
+        i = j;
+    }
+    return groups;
+}
+
+// ------------------------------------------------------------------------------------
+// Struct: PrefixCopy
+// A file whose content is a byte prefix of a larger file, e.g. an interrupted transfer
+// ------------------------------------------------------------------------------------
+struct PrefixCopy {
+    size_t copy;      // record of the smaller file
+    size_t original;  // record of the larger file
+};
+
+// ------------------------------------------------------------------------------------
+// Function: planPrefixCheckpoints
+// Chooses, from the sizes known before hashing, where each file's digest is saved:
+// every power of two from 4 KiB, and the sizes of up to PREFIX_NEIGHBOR_CHECKPOINTS
+// smaller files in the same directory, where interrupted transfers leave their
+// copies. A smaller file can then be confirmed as a prefix by its full digest alone.
+// ------------------------------------------------------------------------------------
+void planPrefixCheckpoints(std::vector<FileRecord>& records) {
+    std::unordered_map<std::string, std::vector<uint64_t>> sizes_by_directory;
+    for (const auto &record : records) {
+        uint64_t size = record.fingerprint.size;
+        if (!record.archive_member && size >= PREFIX_CHECKPOINT_MIN_BYTES && (size & (size - 1)) != 0)
+            sizes_by_directory[std::filesystem::path(record.path).parent_path().string()].push_back(size);
+    }
+    for (auto &[directory, sizes] : sizes_by_directory) {
+        std::sort(sizes.begin(), sizes.end());
+        sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+    }
+    for (auto &record : records) {
+        if (!record.checkpoints().empty()) {
+            record.digests().checkpoints.clear();
+            record.trimDigests();
+        }
+        uint64_t size = record.fingerprint.size;
+        if (record.archive_member || size <= PREFIX_CHECKPOINT_MIN_BYTES)
+            continue;
+        std::vector<uint64_t> offsets;
+        for (uint64_t offset = PREFIX_CHECKPOINT_MIN_BYTES; offset < size; offset *= 2)
+            offsets.push_back(offset);
+        auto it = sizes_by_directory.find(std::filesystem::path(record.path).parent_path().string());
+        if (it != sizes_by_directory.end()) {
+            const std::vector<uint64_t> &sizes = it->second;
+            auto smaller = std::lower_bound(sizes.begin(), sizes.end(), size);
+            for (size_t n = 0; n < PREFIX_NEIGHBOR_CHECKPOINTS && smaller != sizes.begin(); n++)
+                offsets.push_back(*--smaller);
+        }
+        std::sort(offsets.begin(), offsets.end());
+        std::vector<PrefixCheckpoint> &checkpoints = record.digests().checkpoints;
+        for (uint64_t offset : offsets) {
+            PrefixCheckpoint checkpoint;
+            checkpoint.offset = offset;
+            checkpoints.push_back(checkpoint);
+        }
+    }
+}
+
+// ------------------------------------------------------------------------------------
+// Function: findPrefixCopies
+// Finds prefix copies from the checkpoints taken while hashing, without reading any
+// file again: a file is a prefix copy if its full digest equals a larger file's
+// checkpoint at exactly its size. Each copy is reported against the smallest larger
+// file.
+// ------------------------------------------------------------------------------------
+std::vector<PrefixCopy> findPrefixCopies(const std::vector<FileRecord>& records) {
+    auto fullKey = [](const FileRecord &record) -> uint64_t {
+        if (record.digest_slot != NO_DIGEST_SLOT)
+            return record.digest_key;
+        return record.hash().size() >= 16 ? std::stoull(record.hash().substr(0, 16), nullptr, 16) : 0;
+    };
+    // (offset, digest key) -> smallest file with that checkpoint
+    std::map<std::pair<uint64_t, uint64_t>, size_t> checkpoints;
+    for (size_t i = 0; i < records.size(); i++) {
+        for (const auto &checkpoint : records[i].checkpoints()) {
+            if (!checkpoint.taken)
+                continue;
+            auto inserted = checkpoints.insert({{checkpoint.offset, checkpoint.key}, i});
+            if (!inserted.second && records[i].fingerprint.size < records[inserted.first->second].fingerprint.size)
+                inserted.first->second = i;
+        }
+    }
+
+    std::vector<PrefixCopy> copies;
+    for (size_t i = 0; i < records.size(); i++) {
+        const FileRecord &record = records[i];
+        uint64_t size = record.fingerprint.size;
+        if (record.archive_member || !record.hasDigest() || size < PREFIX_CHECKPOINT_MIN_BYTES)
+            continue;
+        auto it = checkpoints.find({size, fullKey(record)});
+        if (it != checkpoints.end())
+            copies.push_back({i, it->second});
+    }
+    return copies;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: sortBySize
+// Orders records by size (then path) so that equal sizes form contiguous buckets
+// ------------------------------------------------------------------------------------
+void sortBySize(std::vector<FileRecord>& records) {
+    std::sort(records.begin(), records.end(), [](const FileRecord &a, const FileRecord &b) {
+        if (a.fingerprint.size != b.fingerprint.size)
+            return a.fingerprint.size < b.fingerprint.size;
+        return a.path < b.path;
+    });
+}
+
+// ------------------------------------------------------------------------------------
+// Struct: TreeEntries
+// What a walk found besides regular files, for callers that copy the tree
+// ------------------------------------------------------------------------------------
+struct TreeEntries {
+    std::vector<std::string> directories;  // below the roots, parents first
+    std::vector<std::string> symlinks;     // to files or directories, not followed
+    std::vector<std::string> others;       // FIFOs, sockets and device nodes
+};
+
+// ------------------------------------------------------------------------------------
+// Function: collectFiles
+// Walks the given directories and records every regular file with its fingerprint.
+// Each directory is listed on its own, so an unreadable or vanished directory is
+// recorded as an error and skipped while the rest of the walk continues. Roots are
+// resolved once up front and symlinks are not followed (neither to directories nor to
+// files), so every recorded path is already canonical and no link is taken for a
+// separate copy of its target. A root that repeats
+// another one, or lies inside it, is walked only once, so no file is recorded twice
+// (and grouped as a duplicate of itself). Quarantine directories left by -quarantine
+// are never entered. With extras, the other entries of the tree are listed there.
+// ------------------------------------------------------------------------------------
+void collectFiles(const std::vector<std::string>& roots, std::vector<FileRecord>& records,
+                  TreeEntries* extras = nullptr) {
+    std::vector<std::filesystem::path> walk_roots;
+    for (const auto &root : roots) {
+        std::error_code ec;
+        std::filesystem::path canonical_root;
+        if (std::filesystem::is_directory(root, ec))
+            canonical_root = std::filesystem::canonical(root, ec);
+        if (ec || canonical_root.empty()) {
+            errorLog.add("Directory not found", root, ec ? ec.message() : "not a directory");
+            continue;
+        }
+        walk_roots.push_back(canonical_root);
+    }
+    // Parents sort before their children
+    std::sort(walk_roots.begin(), walk_roots.end());
+    std::vector<std::filesystem::path> outer_roots;
+    for (const auto &root : walk_roots) {
+        bool nested = false;
+        for (const auto &outer : outer_roots) {
+            if (std::mismatch(outer.begin(), outer.end(), root.begin(), root.end()).first == outer.end())
+                nested = true;
+        }
+        if (!nested)
+            outer_roots.push_back(root);
+    }
+
+    for (const auto &root : outer_roots) {
+        std::error_code ec;
+        std::vector<std::filesystem::path> pending = {root};
+        while (!pending.empty()) {
+            std::filesystem::path dir = std::move(pending.back());
+            pending.pop_back();
+            std::filesystem::directory_iterator it(dir, ec), end;
+            for (; !ec && it != end; it.increment(ec)) {
+                const auto &entry = *it;
+                std::error_code entry_ec;
+                if (entry.is_symlink(entry_ec)) {
+                    if (extras)
+                        extras->symlinks.push_back(entry.path().string());
+                    continue;
+                }
+                if (entry.is_directory(entry_ec)) {
+                    if (entry.path().filename() != QUARANTINE_DIR_NAME) {
+                        pending.push_back(entry.path());
+                        if (extras)
+                            extras->directories.push_back(entry.path().string());
+                    }
+                } else if (!entry.is_regular_file(entry_ec)) {
+                    if (extras && !entry_ec)
+                        extras->others.push_back(entry.path().string());
+                } else {
+                    FileRecord record;
+                    record.path = entry.path().string();
+                    if (getFingerprint(record.path, record.fingerprint))
+                        records.push_back(std::move(record));
+                    else
+                        errorLog.add("Cannot stat file", record.path, std::strerror(errno));
+                }
+            }
+            if (ec)
+                errorLog.add("Cannot read directory", dir.string(), ec.message());
+        }
+    }
+}
+
+// ------------------------------------------------------------------------------------
+// Function: printProgress
+// Prints the hashing progress line with elapsed and estimated total time
+// ------------------------------------------------------------------------------------
+void printProgress(const std::string& algorithm, int current_file, int total_files,
+                   std::chrono::steady_clock::time_point start) {
+    using namespace std::chrono;
+    int percent = (current_file * 100) / total_files;
+    auto elapsed = duration_cast<seconds>(steady_clock::now() - start);
+    int estimated_total = (elapsed.count() * total_files) / current_file;
+    std::cout << "Calculating " << algorithm << " hashes: " 
+              << current_file << "/" << total_files
+              << " (" << percent << "%) Elapsed: " 
+              << formatDuration(elapsed.count())
+              << " Estimated Total: " 
+              << formatDuration(estimated_total) << "\r" << std::flush;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: setIdleIoPriority
+// Moves the calling thread to the idle I/O class, so background work only gets the
+// disk when nobody else is using it
+// ------------------------------------------------------------------------------------
+void setIdleIoPriority() {
+    const int IOPRIO_WHO_PROCESS = 1;
+    const int IOPRIO_CLASS_IDLE = 3;
+    const int IOPRIO_CLASS_SHIFT = 13;
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+// ------------------------------------------------------------------------------------
+// Struct: ReadPacing
+// Background reading (verify): idle I/O priority and a per-device rate cap
+// ------------------------------------------------------------------------------------
+struct ReadPacing {
+    bool idle_priority = false;
+    double max_rate = 0;  // bytes per second per device, 0 for no cap
+};
+
+// ------------------------------------------------------------------------------------
+// Function: runDeviceQueues
+// Runs work on the records at the given indices with one queue per device, each read
+// as its I/O profile says: queue_depth files in flight, in physical (FIEMAP) or walk
+// order. Devices are read in parallel, paced as given. Returns the indices work
+// returned false for.
+// ------------------------------------------------------------------------------------
+std::vector<size_t> runDeviceQueues(const std::vector<FileRecord>& records, const std::vector<size_t>& indices,
+                                    const std::string& algorithm, bool show_progress,
+                                    const std::function<bool(size_t)>& work,
+                                    const ReadPacing& pacing = ReadPacing()) {
+    using namespace std::chrono;
+    std::map<dev_t, std::vector<size_t>> by_device;
+    for (size_t index : indices)
+        by_device[records[index].fingerprint.device].push_back(index);
+    std::mutex mutex;  // guards failed
+    std::vector<size_t> failed;
+    std::atomic<int> done(0);
+    std::vector<std::unique_ptr<std::vector<size_t>>> queues;
+    std::vector<std::unique_ptr<std::atomic<size_t>>> cursors;
+    std::vector<std::unique_ptr<std::atomic<uint64_t>>> device_bytes;
+    std::vector<std::thread> workers;
+    auto device_start = steady_clock::now();
+    for (const auto &entry : by_device) {
+        IoProfile profile = ioProfiles.forDevice(entry.first, records[entry.second.front()].path);
+        auto queue = std::make_unique<std::vector<size_t>>(entry.second);
+        if (profile.physical_order && queue->size() > 1) {
+            std::vector<std::pair<uint64_t, size_t>> order;
+            for (size_t index : *queue)
+                order.push_back({physicalOffset(records[index].path), index});
+            std::sort(order.begin(), order.end());
+            for (size_t i = 0; i < order.size(); i++)
+                (*queue)[i] = order[i].second;
+        }
+        cursors.push_back(std::make_unique<std::atomic<size_t>>(0));
+        device_bytes.push_back(std::make_unique<std::atomic<uint64_t>>(0));
+        int threads = (int)std::min<size_t>(profile.queue_depth, queue->size());
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, queue = queue.get(), cursor = cursors.back().get(),
+                                  bytes = device_bytes.back().get()]() {
+                if (pacing.idle_priority)
+                    setIdleIoPriority();
+                for (size_t i = (*cursor)++; i < queue->size(); i = (*cursor)++) {
+                    size_t index = (*queue)[i];
+                    if (!work(index)) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        failed.push_back(index);
+                    }
+                    done++;
+                    if (pacing.max_rate > 0) {
+                        double total = (double)(*bytes += records[index].fingerprint.size);
+                        double ahead = total / pacing.max_rate - duration<double>(steady_clock::now() - device_start).count();
+                        if (ahead > 0)
+                            std::this_thread::sleep_for(duration<double>(ahead));
+                    }
+                }
+            });
+        }
+        queues.push_back(std::move(queue));
+    }
+
+    int total_files = (int)indices.size();
+    auto start = steady_clock::now();
+    while (show_progress && done < total_files) {
+        std::this_thread::sleep_for(milliseconds(200));
+        if (done > 0)
+            printProgress(algorithm, done, total_files, start);
+    }
+    for (auto &worker : workers)
+        worker.join();
+    if (show_progress && total_files > 0) {
+        printProgress(algorithm, done, total_files, start);
+        std::cout << std::endl;
+    }
+    return failed;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: hashRecords
+// Hashes the records at the given indices with live-filesystem checks and bounded
+// retries, all devices through runDeviceQueues. Archive members found along the way
+// are appended to member_records.
+// With checkpoints, prefix checkpoints are kept in each record. on_hashed, if given,
+// gets each record once its digest is final (one call at a time). Retries are read
+// with the same device queues and pacing.
+// ------------------------------------------------------------------------------------
+void hashRecords(std::vector<FileRecord>& records, const std::vector<size_t>& indices,
+                 const std::string& algorithm, bool scan_archives, bool show_progress,
+                 std::vector<FileRecord>& member_records, bool checkpoints = false,
+                 const std::function<void(FileRecord&)>& on_hashed = nullptr,
+                 const ReadPacing& pacing = ReadPacing()) {
+    using namespace std::chrono;
+    std::mutex mutex;  // guards member_records and on_hashed
+    auto hashRecord = [&](FileRecord &record) {
+        std::vector<ArchiveMember> members;
+        RecordDigests &digests = record.digests();
+        if (!hashStableFile(record.path, algorithm, scan_archives, digests.hash, members, record.fingerprint,
+                            checkpoints ? &digests.checkpoints : nullptr)) {
+            digests.hash.clear();
+            record.trimDigests();
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &member : members) {
+            FileRecord member_record;
+            member_record.path = record.path + ARCHIVE_MEMBER_SEPARATOR + member.name;
+            member_record.fingerprint.size = (off_t)member.size;
+            member_record.digests().hash = member.hash;
+            member_record.archive_member = true;
+            member_records.push_back(std::move(member_record));
+        }
+        if (on_hashed && !record.hash().empty())
+            on_hashed(record);
+        return true;
+    };
+
+    // Files that changed while being read are retried after the main pass, so that
+    // they can settle; one retry round per call however many files are busy
+    auto work = [&](size_t index) { return hashRecord(records[index]); };
+    std::vector<size_t> changed_files = runDeviceQueues(records, indices, algorithm, show_progress, work, pacing);
+    for (int attempt = 1; attempt <= MAX_HASH_RETRIES && !changed_files.empty(); attempt++) {
+        std::this_thread::sleep_for(seconds(attempt));
+        changed_files = runDeviceQueues(records, changed_files, algorithm, false, work, pacing);
+    }
+    for (size_t index : changed_files) {
+        errorLog.add("Unstable", records[index].path,
+                     "changed during " + std::to_string(MAX_HASH_RETRIES + 1) + " hash attempts");
+    }
+}
+
+// ------------------------------------------------------------------------------------
+// Function: getPartialHash
+// Hashes the first (with with_tail also the last) PARTIAL_HASH_BYTES of a file.
+// Returns "H:<hex>" or "HT:<hex>", or an empty string (recorded in the error log) if
+// the file cannot be read; the caller then hashes the whole bucket in full.
+// ------------------------------------------------------------------------------------
+std::string getPartialHash(const std::string& path, uint64_t size, const std::string& algorithm, bool with_tail) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        errorLog.add("Cannot open file", path, std::string(std::strerror(errno)) + " (probe; hashed in full instead)");
+        if (fd >= 0)
+            close(fd);
+        return "";
+    }
+    std::string output;
+    try {
+        auto hash = createHashFunction(algorithm);
+        CryptoPP::HashFilter filter(*hash, new CryptoPP::HexEncoder(new CryptoPP::StringSink(output)));
+        std::vector<char> buf((size_t)std::min(size, PARTIAL_HASH_BYTES));
+        for (int probe = 0; probe < (with_tail ? 2 : 1); probe++) {
+            off_t offset = probe == 1 ? (off_t)(size - buf.size()) : 0;
+            ssize_t got = ioBackend->read(fd, st, buf.data(), buf.size(), offset);
+            if (got != (ssize_t)buf.size()) {
+                errorLog.add("Hash error for file", path,
+                             (got < 0 ? std::string(std::strerror(errno)) : "short read") + " at offset " +
+                             std::to_string(offset) + " (probe; hashed in full instead)");
+                close(fd);
+                return "";
+            }
+            filter.Put(reinterpret_cast<const CryptoPP::byte*>(buf.data()), buf.size());
+        }
+        filter.MessageEnd();
+    } catch (const std::exception &e) {
+        errorLog.add("Hash error for file", path, e.what());
+        output.clear();
+    }
+    close(fd);
+    return output.empty() ? "" : (with_tail ? "HT:" : "H:") + output;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: residentFraction
+// Share of a file's pages that are already in the page cache (0.0 - 1.0)
+// ------------------------------------------------------------------------------------
+double residentFraction(const std::string& path, uint64_t size) {
+    if (size == 0)
+        return 1.0;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0.0;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0.0;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> resident((size + page - 1) / page);
+    double fraction = 0.0;
+    if (mincore(map, size, resident.data()) == 0) {
+        size_t count = std::count_if(resident.begin(), resident.end(), [](unsigned char c) { return c & 1; });
+        fraction = (double)count / resident.size();
+    }
+    munmap(map, size);
+    return fraction;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: compareLockstep
+// Reads the files of one size bucket side by side in chunks and splits them into
+// classes of identical content. A file stops being read as soon as it differs from
+// all others. Returns false if a file cannot be read or changes during the comparison.
+// ------------------------------------------------------------------------------------
+bool compareLockstep(const std::vector<FileRecord*>& files, std::vector<std::vector<size_t>>& classes) {
+    size_t n = files.size();
+    uint64_t size = files[0]->fingerprint.size;
+    struct OpenFiles {
+        std::vector<int> fds;
+        std::vector<struct stat> stats;
+        ~OpenFiles() {
+            for (int fd : fds)
+                close(fd);
+        }
+    } open_files;
+    std::vector<FileFingerprint> before(n);
+    for (size_t i = 0; i < n; i++) {
+        int fd = open(files[i]->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        open_files.fds.push_back(fd);
+        open_files.stats.emplace_back();
+        if (fstat(fd, &open_files.stats.back()) != 0 || !getFingerprint(files[i]->path, before[i]))
+            return false;
+    }
+
+    std::vector<std::vector<char>> chunks(n);
+    std::vector<std::vector<size_t>> open_groups(1);
+    for (size_t i = 0; i < n; i++)
+        open_groups[0].push_back(i);
+    for (uint64_t offset = 0; offset < size && !open_groups.empty(); offset += LOCKSTEP_CHUNK_BYTES) {
+        size_t len = (size_t)std::min<uint64_t>(LOCKSTEP_CHUNK_BYTES, size - offset);
+        std::vector<std::vector<size_t>> next_groups;
+        for (const auto &group : open_groups) {
+            std::vector<std::vector<size_t>> split;
+            for (size_t i : group) {
+                chunks[i].resize(len);
+                if (ioBackend->read(open_files.fds[i], open_files.stats[i], chunks[i].data(), len, (off_t)offset) != (ssize_t)len)
+                    return false;
+                auto same = std::find_if(split.begin(), split.end(), [&](const std::vector<size_t> &g) {
+                    return std::memcmp(chunks[g[0]].data(), chunks[i].data(), len) == 0;
+                });
+                if (same == split.end())
+                    split.push_back({i});
+                else
+                    same->push_back(i);
+            }
+            for (auto &g : split) {
+                if (g.size() > 1)
+                    next_groups.push_back(std::move(g));
+            }
+        }
+        open_groups.swap(next_groups);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        FileFingerprint after;
+        if (!getFingerprint(files[i]->path, after) || after != before[i])
+            return false;
+        files[i]->fingerprint = before[i];
+    }
+    classes = open_groups;
+    return true;
+}
+
+// ------------------------------------------------------------------------------------
+// Class: StagePlanner
+// Decides per size bucket how duplicates are confirmed: full hash, head probe then
+// full hash, head and tail probe then full hash, or lockstep byte comparison. Costs
+// are estimated from the measured hash throughput, a per-device read model (measured
+// by a timed sample read before planning, else seeded from the rotational flag),
+// page-cache residency and a fixed guess of how selective each probe is. Every bucket
+// is planned before any of them is read, so nothing observed later changes a plan.
+// ------------------------------------------------------------------------------------
+class StagePlanner {
+public:
+    enum Strategy { FULL_HASH, HEAD_THEN_FULL, HEAD_TAIL_THEN_FULL, LOCKSTEP, STRATEGY_COUNT };
+
+    explicit StagePlanner(const std::string& algorithm) {
+        // Calibrate the hash throughput on an in-memory buffer
+        using namespace std::chrono;
+        auto hash = createHashFunction(algorithm);
+        std::vector<CryptoPP::byte> buf(1024 * 1024), digest(hash->DigestSize());
+        auto start = steady_clock::now();
+        for (int i = 0; i < 16; i++)
+            hash->Update(buf.data(), buf.size());
+        hash->Final(digest.data());
+        double elapsed = duration<double>(steady_clock::now() - start).count();
+        hash_bytes_per_second_ = 16.0 * buf.size() / std::max(elapsed, 1e-6);
+    }
+
+    // Measures the read model of every device the files live on, once per device:
+    // a timed read of the last 4 KiB of an uncached file (seek and latency), then of
+    // up to CALIBRATION_BYTES from its start (throughput). The largest files are tried
+    // first; a device without an uncached file of CALIBRATION_MIN_BYTES keeps the
+    // default model for its type.
+    void calibrate(const std::vector<FileRecord*>& files) {
+        std::map<dev_t, std::vector<const FileRecord*>> by_device;
+        for (const auto *record : files) {
+            if (!record->archive_member && (uint64_t)record->fingerprint.size >= CALIBRATION_MIN_BYTES)
+                by_device[record->fingerprint.device].push_back(record);
+        }
+        for (auto &[dev, candidates] : by_device) {
+            DeviceModel &model = device(dev);
+            if (model.calibrated)
+                continue;
+            size_t tries = std::min(candidates.size(), CALIBRATION_CANDIDATES);
+            std::partial_sort(candidates.begin(), candidates.begin() + tries, candidates.end(),
+                              [](const FileRecord *a, const FileRecord *b) {
+                                  return a->fingerprint.size > b->fingerprint.size;
+                              });
+            for (size_t i = 0; i < tries && !model.calibrated; i++)
+                sampleRead(*candidates[i], model);
+        }
+    }
+
+    Strategy plan(const std::vector<FileRecord*>& bucket, bool allow_lockstep) {
+        uint64_t size = bucket[0]->fingerprint.size;
+        bool has_member = false, has_hash = false;
+        for (const auto *record : bucket) {
+            has_member |= record->archive_member;
+            has_hash |= !record->hash().empty();
+        }
+
+        // Small files are read whole by any probe, and archive members can only be
+        // compared by their full hash. Files a shard already hashed are never read again.
+        Strategy best = FULL_HASH;
+        double cost[STRATEGY_COUNT] = {};
+        if (size > PARTIAL_HASH_BYTES && !has_member) {
+            double lockstep_bytes = DUPLICATE_SHARE * size +
+                                    (1 - DUPLICATE_SHARE) * std::min<uint64_t>(size, LOCKSTEP_CHUNK_BYTES);
+            for (const auto *record : bucket) {
+                if (!record->hash().empty())
+                    continue;
+                double resident = residentFraction(record->path, size);
+                double full = readCost(*record, size, 1, resident) + size / hash_bytes_per_second_;
+                double head = PARTIAL_HASH_BYTES / hash_bytes_per_second_;
+                cost[FULL_HASH] += full;
+                cost[HEAD_THEN_FULL] += readCost(*record, PARTIAL_HASH_BYTES, 1, resident) + head + HEAD_SURVIVOR_SHARE * full;
+                cost[HEAD_TAIL_THEN_FULL] += (size > 2 * PARTIAL_HASH_BYTES)
+                    ? readCost(*record, 2 * PARTIAL_HASH_BYTES, 2, resident) + 2 * head + HEAD_TAIL_SURVIVOR_SHARE * full
+                    : std::numeric_limits<double>::infinity();
+                // Interleaved reads seek between files on every chunk of a rotational disk
+                int seeks = device(record->fingerprint.device).rotational
+                    ? (int)std::ceil(lockstep_bytes / LOCKSTEP_CHUNK_BYTES) : 1;
+                cost[LOCKSTEP] += readCost(*record, (uint64_t)lockstep_bytes, seeks, resident);
+            }
+            if (!allow_lockstep || has_hash || bucket.size() > LOCKSTEP_MAX_FILES)
+                cost[LOCKSTEP] = std::numeric_limits<double>::infinity();
+            for (int s = HEAD_THEN_FULL; s < STRATEGY_COUNT; s++) {
+                if (cost[s] < cost[best])
+                    best = (Strategy)s;
+            }
+        } else {
+            for (const auto *record : bucket) {
+                if (record->hash().empty())
+                    cost[FULL_HASH] += readCost(*record, size, 1, 0) + size / hash_bytes_per_second_;
+            }
+        }
+        choices_[best]++;
+        estimated_seconds_ += cost[best];
+        return best;
+    }
+
+    void report(std::ostream& out) const {
+        out << "Planner: " << choices_[FULL_HASH] << " buckets full hash, "
+            << choices_[HEAD_THEN_FULL] << " head + full, "
+            << choices_[HEAD_TAIL_THEN_FULL] << " head/tail + full, "
+            << choices_[LOCKSTEP] << " lockstep compare; estimated cost "
+            << formatDuration((int)estimated_seconds_) << ", hash throughput "
+            << (int)(hash_bytes_per_second_ / (1024 * 1024)) << " MiB/s\n";
+        for (const auto &[dev, model] : devices_) {
+            out << "Planner device " << major(dev) << ":" << minor(dev) << ": "
+                << (int)(model.bytes_per_second / (1024 * 1024)) << " MiB/s, "
+                << std::fixed << std::setprecision(1) << model.seek_seconds * 1000 << " ms per seek"
+                << std::defaultfloat << (model.calibrated ? " (sampled)" : model.rotational ? " (HDD default)" : " (SSD default)")
+                << "\n";
+        }
+    }
+
+private:
+    // Assumed share of probed files that share their probe hash with another file,
+    // and of compared files that turn out to be duplicates
+    static constexpr double HEAD_SURVIVOR_SHARE = 0.5;
+    static constexpr double HEAD_TAIL_SURVIVOR_SHARE = 0.4;
+    static constexpr double DUPLICATE_SHARE = 0.4;
+
+    struct DeviceModel {
+        bool rotational;
+        double seek_seconds;
+        double bytes_per_second;
+        bool calibrated = false;
+    };
+
+    DeviceModel& device(dev_t dev) {
+        auto it = devices_.find(dev);
+        if (it == devices_.end()) {
+            bool rotational = isRotationalDevice(dev);
+            DeviceModel model = rotational ? DeviceModel{true, 0.008, 150e6} : DeviceModel{false, 0.0001, 1e9};
+            it = devices_.emplace(dev, model).first;
+        }
+        return it->second;
+    }
+
+    // One timed sample read (see calibrate); leaves the model alone if the file is
+    // cached or cannot be read
+    void sampleRead(const FileRecord& record, DeviceModel& model) {
+        using namespace std::chrono;
+        uint64_t size = record.fingerprint.size;
+        if (residentFraction(record.path, size) > 0.1)
+            return;
+        int fd = open(record.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        std::vector<char> buf(1024 * 1024);
+        auto start = steady_clock::now();
+        ok = ok && ioBackend->read(fd, st, buf.data(), 4096, (off_t)((size - 4096) & ~(uint64_t)4095)) == 4096;
+        double seek = duration<double>(steady_clock::now() - start).count();
+        uint64_t bytes = std::min(size, CALIBRATION_BYTES);
+        for (uint64_t pos = 0; ok && pos < bytes; pos += buf.size()) {
+            size_t want = (size_t)std::min<uint64_t>(buf.size(), bytes - pos);
+            ok = ioBackend->read(fd, st, buf.data(), want, (off_t)pos) == (ssize_t)want;
+        }
+        // The sequential read starts with one more seek, back to the start of the file
+        double sequential = duration<double>(steady_clock::now() - start).count() - seek;
+        close(fd);
+        if (!ok)
+            return;
+        model.seek_seconds = seek;
+        model.bytes_per_second = bytes / std::max({sequential - seek, 0.5 * sequential, 1e-6});
+        model.calibrated = true;
+    }
+
+    double readCost(const FileRecord& record, uint64_t bytes, int seeks, double resident) {
+        const double MEMORY_BYTES_PER_SECOND = 8e9;
+        DeviceModel &model = device(record.fingerprint.device);
+        return (1 - resident) * (seeks * model.seek_seconds + bytes / model.bytes_per_second) +
+               resident * bytes / MEMORY_BYTES_PER_SECOND;
+    }
+
+    double hash_bytes_per_second_;
+    std::map<dev_t, DeviceModel> devices_;
+    size_t choices_[STRATEGY_COUNT] = {};
+    double estimated_seconds_ = 0;
+};
+
+// ------------------------------------------------------------------------------------
+// Function: confirmBuckets
+// Confirms the duplicates of the given size buckets. The planner samples each device's
+// read rate, every bucket is planned, then each stage runs once over the files of all buckets: the lockstep comparisons,
+// one probe pass and one full-hash pass. Each device queue therefore holds all of its
+// files for a stage, and busy files are waited for in one retry round per stage, not
+// per bucket. Afterwards every record that has a duplicate carries a full hash or,
+// after a lockstep comparison, a "BYTES-<size>-<n>" group key. With digests, each
+// digest moves to the compact index as soon as it is final.
+// ------------------------------------------------------------------------------------
+void confirmBuckets(std::vector<FileRecord>& records, const std::vector<std::vector<size_t>>& buckets,
+                    StagePlanner& planner, const std::string& algorithm, bool allow_lockstep,
+                    bool show_progress, DigestStore* digests = nullptr) {
+    auto bucketFiles = [&](const std::vector<size_t> &bucket) {
+        std::vector<FileRecord*> files;
+        for (size_t index : bucket)
+            files.push_back(&records[index]);
+        return files;
+    };
+    std::vector<FileRecord*> all_files;
+    for (const auto &bucket : buckets) {
+        for (size_t index : bucket)
+            all_files.push_back(&records[index]);
+    }
+    planner.calibrate(all_files);
+    std::vector<StagePlanner::Strategy> strategies;
+    for (const auto &bucket : buckets)
+        strategies.push_back(planner.plan(bucketFiles(bucket), allow_lockstep));
+
+    for (size_t b = 0; b < buckets.size(); b++) {
+        if (strategies[b] != StagePlanner::LOCKSTEP)
+            continue;
+        std::vector<FileRecord*> files = bucketFiles(buckets[b]);
+        uint64_t size = files[0]->fingerprint.size;
+        std::vector<std::vector<size_t>> classes;
+        if (compareLockstep(files, classes)) {
+            for (size_t c = 0; c < classes.size(); c++) {
+                for (size_t i : classes[c])
+                    files[i]->digests().hash = "BYTES-" + std::to_string(size) + "-" + std::to_string(c);
+            }
+        } else {
+            // Unreadable or changing files: fall back to hashing with retries
+            strategies[b] = StagePlanner::FULL_HASH;
+        }
+    }
+
+    // One probe pass over the files of every probed bucket. Files that already have
+    // their full hash (from a shard) are not read; shards may also carry the probe.
+    std::vector<size_t> to_probe;
+    std::unordered_set<size_t> with_tail;
+    for (size_t b = 0; b < buckets.size(); b++) {
+        if (strategies[b] != StagePlanner::HEAD_THEN_FULL && strategies[b] != StagePlanner::HEAD_TAIL_THEN_FULL)
+            continue;
+        bool tail = strategies[b] == StagePlanner::HEAD_TAIL_THEN_FULL;
+        std::string kind = tail ? "HT:" : "H:";
+        for (size_t index : buckets[b]) {
+            if (!records[index].hash().empty() || records[index].partialHash().compare(0, kind.size(), kind) == 0)
+                continue;
+            to_probe.push_back(index);
+            if (tail)
+                with_tail.insert(index);
+        }
+    }
+    runDeviceQueues(records, to_probe, algorithm, show_progress, [&](size_t index) {
+        FileRecord &record = records[index];
+        record.digests().partial_hash = getPartialHash(record.path, record.fingerprint.size, algorithm,
+                                                       with_tail.count(index) > 0);
+        record.trimDigests();
+        return true;
+    });
+
+    // One full-hash pass over the probe survivors and the full-hash buckets
+    std::vector<size_t> to_hash;
+    for (size_t b = 0; b < buckets.size(); b++) {
+        if (strategies[b] == StagePlanner::FULL_HASH) {
+            for (size_t index : buckets[b]) {
+                if (records[index].hash().empty() && !records[index].archive_member)
+                    to_hash.push_back(index);
+            }
+        } else if (strategies[b] != StagePlanner::LOCKSTEP) {
+            // A file without a probe of this kind (it failed, or a shard hashed the file
+            // but stored another probe) can match any other file, so such a bucket is
+            // hashed in full; its already hashed files are not read again
+            std::string kind = strategies[b] == StagePlanner::HEAD_TAIL_THEN_FULL ? "HT:" : "H:";
+            std::map<std::string, std::vector<size_t>> by_partial;
+            for (size_t index : buckets[b]) {
+                const std::string &partial = records[index].partialHash();
+                if (partial.compare(0, kind.size(), kind) != 0) {
+                    by_partial.clear();
+                    by_partial[""] = buckets[b];
+                    break;
+                }
+                by_partial[partial].push_back(index);
+            }
+            for (const auto &[partial, group] : by_partial) {
+                if (group.size() < 2)
+                    continue;
+                for (size_t index : group) {
+                    if (records[index].hash().empty())
+                        to_hash.push_back(index);
+                }
+            }
+        }
+    }
+    std::vector<FileRecord> no_members;
+    hashRecords(records, to_hash, algorithm, false, show_progress, no_members, false, [&](FileRecord &record) {
+        if (digests)
+            digests->compact(record);
+    });
+}
+
+// ------------------------------------------------------------------------------------
+// Function: hashCandidates
+// Confirms only what can have a duplicate: files sharing their size with another file
+// or archive member, each bucket as the planner decides. With scan_archives, archives
+// are read first so that their members take part in the size buckets. Digests move to
+// the compact index (if enabled) as they are computed. Partial hashes are released once
+// every bucket is confirmed, unless keep_partial_hashes (a shard is being written).
+// Leaves records sorted by size.
+// ------------------------------------------------------------------------------------
+void hashCandidates(std::vector<FileRecord>& records, const std::string& algorithm, bool scan_archives,
+                    StagePlanner& planner, DigestStore& digests, bool allow_lockstep, bool keep_partial_hashes,
+                    bool show_progress) {
+    std::vector<FileRecord> member_records;
+    if (scan_archives) {
+        std::vector<size_t> archives;
+        for (size_t i = 0; i < records.size(); i++) {
+            if (!records[i].archive_member && records[i].hash().empty() && isSupportedArchive(records[i].path))
+                archives.push_back(i);
+        }
+        hashRecords(records, archives, algorithm, true, show_progress, member_records);
+        std::move(member_records.begin(), member_records.end(), std::back_inserter(records));
+        member_records.clear();
+    }
+
+    sortBySize(records);
+    std::vector<std::vector<size_t>> buckets;
+    for (size_t i = 0; i < records.size();) {
+        size_t j = i;
+        while (j < records.size() && records[j].fingerprint.size == records[i].fingerprint.size)
+            j++;
+        if (j - i > 1) {
+            buckets.emplace_back();
+            for (size_t k = i; k < j; k++)
+                buckets.back().push_back(k);
+        }
+        i = j;
+    }
+    confirmBuckets(records, buckets, planner, algorithm, allow_lockstep && !digests.enabled(), show_progress, &digests);
+
+    // Archives and their members, and files hashed before the buckets
+    for (auto &record : records) {
+        digests.compact(record);
+        if (!keep_partial_hashes && !record.partialHash().empty()) {
+            std::string().swap(record.digests().partial_hash);
+            record.trimDigests();
+        }
+    }
+}
+
+#ifdef MYDUPEFINDER_WITH_EXT2FS
+// ------------------------------------------------------------------------------------
+// Class: Ext4Image
+// Read-only view of an ext2/3/4 image (or an unmounted block device such as an LVM
+// snapshot) through libext2fs, without mounting it. Discovery scans the inode tables
+// in on-disk order, then walks the directory blocks breadth first, each level in
+// inode order. File data is read from the inode's extents, files ordered by their
+// first physical block, so that the image is read in one forward sweep.
+// ------------------------------------------------------------------------------------
+class Ext4Image {
+public:
+    explicit Ext4Image(const std::string& image) : image_(image) {}
+    ~Ext4Image() {
+        if (fs_)
+            ext2fs_close_free(&fs_);
+    }
+
+    bool open(std::string& error) {
+        errcode_t err = ext2fs_open(image_.c_str(), EXT2_FLAG_64BITS, 0, 0, unix_io_manager, &fs_);
+        if (err) {
+            fs_ = nullptr;
+            error = error_message(err);
+            return false;
+        }
+        return true;
+    }
+
+    const std::string& path() const { return image_; }
+
+    // Appends a member record ("<image>!/<path>") per regular file, with the inode
+    // number as fingerprint inode. A file with several hard links is listed once.
+    void collect(std::vector<FileRecord>& records) {
+        DirectoryWalk walk{image_ + ARCHIVE_MEMBER_SEPARATOR, "", {}, {}, {}, records};
+        ext2_inode_scan scan;
+        errcode_t err = ext2fs_open_inode_scan(fs_, 0, &scan);
+        if (err) {
+            errorLog.add("Cannot scan inodes of image", image_, error_message(err));
+            return;
+        }
+        ext2_ino_t ino;
+        struct ext2_inode inode;
+        while ((err = ext2fs_get_next_inode(scan, &ino, &inode)) == 0 && ino != 0) {
+            if (inode.i_links_count == 0)
+                continue;
+            if (LINUX_S_ISDIR(inode.i_mode)) {
+                walk.directories.insert(ino);
+            } else if (LINUX_S_ISREG(inode.i_mode)) {
+                FileFingerprint &fp = walk.files[ino];
+                fp.inode = ino;
+                fp.size = (off_t)EXT2_I_SIZE(&inode);
+                fp.mtime.tv_sec = inode.i_mtime;
+                fp.ctime.tv_sec = inode.i_ctime;
+            }
+        }
+        ext2fs_close_inode_scan(scan);
+        if (err)
+            errorLog.add("Cannot scan inodes of image", image_, error_message(err));
+
+        std::vector<std::pair<ext2_ino_t, std::string>> level = {{EXT2_ROOT_INO, ""}};
+        walk.directories.erase(EXT2_ROOT_INO);
+        while (!level.empty()) {
+            std::sort(level.begin(), level.end());
+            walk.next.clear();
+            for (const auto &[dir, dir_path] : level) {
+                walk.dir_path = dir_path;
+                err = ext2fs_dir_iterate2(fs_, dir, 0, nullptr, visitEntry, &walk);
+                if (err)
+                    errorLog.add("Cannot read directory in image", walk.member_prefix + dir_path, error_message(err));
+            }
+            level.swap(walk.next);
+        }
+    }
+
+    // Hashes the records at the given indices (members of this image) in the order of
+    // their first physical block. Returns the number of bytes read.
+    uint64_t hash(std::vector<FileRecord>& records, const std::vector<size_t>& indices, const std::string& algorithm) {
+        std::vector<std::pair<blk64_t, size_t>> order;
+        for (size_t index : indices) {
+            blk64_t physical = 0;  // stays 0 for empty and inline files
+            ext2fs_bmap2(fs_, (ext2_ino_t)records[index].fingerprint.inode, nullptr, nullptr, 0, 0, nullptr, &physical);
+            order.push_back({physical, index});
+        }
+        std::sort(order.begin(), order.end());
+
+        std::vector<char> buffer(IMAGE_READ_BYTES);
+        uint64_t bytes_read = 0;
+        for (const auto &[physical, index] : order) {
+            FileRecord &record = records[index];
+            ext2_file_t file;
+            errcode_t err = ext2fs_file_open(fs_, (ext2_ino_t)record.fingerprint.inode, 0, &file);
+            if (err) {
+                errorLog.add("Hash error for file", record.path, error_message(err));
+                continue;
+            }
+            auto hash = createHashFunction(algorithm);
+            uint64_t remaining = record.fingerprint.size;
+            unsigned int got = 0;
+            while (remaining > 0 && (err = ext2fs_file_read(file, buffer.data(), IMAGE_READ_BYTES, &got)) == 0 && got > 0) {
+                size_t used = (size_t)std::min<uint64_t>(got, remaining);
+                hash->Update(reinterpret_cast<const CryptoPP::byte*>(buffer.data()), used);
+                remaining -= used;
+                bytes_read += got;
+            }
+            ext2fs_file_close(file);
+            // Inline data comes back with the padding of the inode's inline area and
+            // ends there; past it, up to the file size, the file reads as zeros
+            std::fill(buffer.begin(), buffer.end(), 0);
+            while (!err && remaining > 0) {
+                size_t used = (size_t)std::min<uint64_t>(buffer.size(), remaining);
+                hash->Update(reinterpret_cast<const CryptoPP::byte*>(buffer.data()), used);
+                remaining -= used;
+            }
+            if (err) {
+                errorLog.add("Hash error for file", record.path, error_message(err));
+                continue;
+            }
+            std::string digest(hash->DigestSize(), '\0');
+            hash->Final(reinterpret_cast<CryptoPP::byte*>(&digest[0]));
+            CryptoPP::HexEncoder encoder(new CryptoPP::StringSink(record.digests().hash));
+            encoder.Put(reinterpret_cast<const CryptoPP::byte*>(digest.data()), digest.size());
+            encoder.MessageEnd();
+        }
+        return bytes_read;
+    }
+
+private:
+    struct DirectoryWalk {
+        std::string member_prefix;  // "<image>!/"
+        std::string dir_path;       // directory being read, "" or "a/b/"
+        std::unordered_map<ext2_ino_t, FileFingerprint> files;  // not yet named
+        std::unordered_set<ext2_ino_t> directories;             // not yet visited
+        std::vector<std::pair<ext2_ino_t, std::string>> next;   // next directory level
+        std::vector<FileRecord>& records;
+    };
+
+    static int visitEntry(ext2_ino_t, int, struct ext2_dir_entry* dirent, int, int, char*, void* data) {
+        auto &walk = *static_cast<DirectoryWalk*>(data);
+        std::string name(dirent->name, ext2fs_dirent_name_len(dirent));
+        if (dirent->inode == 0 || name == "." || name == "..")
+            return 0;
+        if (walk.directories.erase(dirent->inode)) {
+            walk.next.push_back({dirent->inode, walk.dir_path + name + "/"});
+            return 0;
+        }
+        auto it = walk.files.find(dirent->inode);
+        if (it != walk.files.end()) {
+            FileRecord record;
+            record.path = walk.member_prefix + walk.dir_path + name;
+            record.fingerprint = it->second;
+            record.archive_member = true;
+            walk.records.push_back(std::move(record));
+            walk.files.erase(it);
+        }
+        return 0;
+    }
+
+    std::string image_;
+    ext2_filsys fs_ = nullptr;
+};
+
+// ------------------------------------------------------------------------------------
+// Function: scanExt4Images
+// Discovers the files of ext4 images and hashes those that can have a duplicate among
+// the images and the collected records (every file with hash_all). Hashed files are
+// appended as members: reported like archive members, never deleted. Returns the
+// number of image files hashed, or -1 if an image cannot be opened.
+// ------------------------------------------------------------------------------------
+int scanExt4Images(const std::vector<std::string>& images, std::vector<FileRecord>& records,
+                   const std::string& algorithm, bool hash_all, std::ostream& logFile) {
+    std::vector<std::unique_ptr<Ext4Image>> opened;
+    std::vector<FileRecord> members;
+    std::vector<size_t> first_member;
+    for (const auto &path : images) {
+        auto image = std::make_unique<Ext4Image>(path);
+        std::string error;
+        if (!image->open(error)) {
+            std::cerr << "Error: Cannot open ext4 image " << path << ": " << error << std::endl;
+            return -1;
+        }
+        first_member.push_back(members.size());
+        image->collect(members);
+        opened.push_back(std::move(image));
+    }
+    first_member.push_back(members.size());
+
+    std::unordered_map<uint64_t, int> size_counts;
+    for (const auto &record : records)
+        size_counts[record.fingerprint.size]++;
+    for (const auto &member : members)
+        size_counts[member.fingerprint.size]++;
+
+    int hashed = 0;
+    for (size_t i = 0; i < opened.size(); i++) {
+        std::vector<size_t> candidates;
+        for (size_t m = first_member[i]; m < first_member[i + 1]; m++) {
+            if (hash_all || size_counts[members[m].fingerprint.size] > 1)
+                candidates.push_back(m);
+        }
+        uint64_t bytes_read = opened[i]->hash(members, candidates, algorithm);
+        int image_hashed = (int)std::count_if(candidates.begin(), candidates.end(),
+                                              [&](size_t m) { return !members[m].hash().empty(); });
+        std::ostringstream summary;
+        summary << "Image " << opened[i]->path() << ": " << first_member[i + 1] - first_member[i] << " files, "
+                << image_hashed << " hashed (" << formatBytes(bytes_read) << " read)\n";
+        std::cout << summary.str();
+        logFile << summary.str();
+        hashed += image_hashed;
+    }
+    for (auto &member : members) {
+        if (!member.hash().empty())
+            records.push_back(std::move(member));
+    }
+    return hashed;
+}
+#else
+int scanExt4Images(const std::vector<std::string>&, std::vector<FileRecord>&, const std::string&, bool, std::ostream&) {
+    std::cerr << "Error: ext4 image support is not compiled in (build with -DMYDUPEFINDER_WITH_EXT2FS).\n";
+    return -1;
+}
+#endif
+
+// ------------------------------------------------------------------------------------
+// Functions: escapeField / unescapeField
+// Keep tabs, newlines and backslashes in paths from breaking the shard line format
+// ------------------------------------------------------------------------------------
+std::string escapeField(const std::string& value) {
+    std::string out;
+    for (char c : value) {
+        if (c == '\\') out += "\\\\";
+        else if (c == '\t') out += "\\t";
+        else if (c == '\n') out += "\\n";
+        else out += c;
+    }
+    return out;
+}
+
+std::string unescapeField(const std::string& value) {
+    std::string out;
+    for (size_t i = 0; i < value.size(); i++) {
+        if (value[i] == '\\' && i + 1 < value.size()) {
+            char c = value[++i];
+            out += (c == 't') ? '\t' : (c == 'n') ? '\n' : c;
+        } else {
+            out += value[i];
+        }
+    }
+    return out;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: writeShard
+// Writes a partial scan result, sorted by size so that shards can be k-way merged.
+// After the header (magic, algorithm, roots, "files") there is one line per file:
+//   size  device  inode  mtime_s  mtime_ns  ctime_s  ctime_ns  member  partial|-  hash|-  path
+// Files the shard did not need to hash are written with "-" as (partial) hash.
+// ------------------------------------------------------------------------------------
+bool writeShard(const std::string& shardfile, const std::string& algorithm, const std::vector<std::string>& roots,
+                std::vector<FileRecord>& records, DigestStore& digests) {
+    sortBySize(records);
+    std::string tmpfile = shardfile + ".tmp";
+    std::ofstream out(tmpfile);
+    if (!out) {
+        std::cerr << "Cannot write shard file: " << tmpfile << std::endl;
+        return false;
+    }
+    out << SHARD_MAGIC << "\n";
+    out << "algorithm " << algorithm << "\n";
+    for (const auto &root : roots)
+        out << "root " << escapeField(std::filesystem::weakly_canonical(root).string()) << "\n";
+    out << "files\n";
+    for (const auto &record : records) {
+        const FileFingerprint &fp = record.fingerprint;
+        out << fp.size << '\t' << fp.device << '\t' << fp.inode << '\t'
+            << fp.mtime.tv_sec << '\t' << fp.mtime.tv_nsec << '\t'
+            << fp.ctime.tv_sec << '\t' << fp.ctime.tv_nsec << '\t'
+            << (record.archive_member ? 1 : 0) << '\t'
+            << (record.partialHash().empty() ? "-" : record.partialHash()) << '\t'
+            << (record.hasDigest() ? digests.digest(record) : "-") << '\t'
+            << escapeField(record.path) << '\n';
+    }
+    out.close();
+    if (!out) {
+        std::cerr << "Error writing shard file: " << tmpfile << std::endl;
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpfile, shardfile, ec);
+    if (ec) {
+        std::cerr << "Cannot write shard file: " << shardfile << " - " << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// ------------------------------------------------------------------------------------
+// Class: ShardReader
+// Streams the records of a shard file in size order
+// ------------------------------------------------------------------------------------
+class ShardReader {
+public:
+    explicit ShardReader(const std::string& path) : path_(path), in_(path) {
+        std::string line;
+        if (!in_ || !std::getline(in_, line) || line != SHARD_MAGIC)
+            throw std::runtime_error("not a shard file: " + path);
+        while (std::getline(in_, line) && line != "files") {
+            if (line.compare(0, 10, "algorithm ") == 0)
+                algorithm_ = line.substr(10);
+            else if (line.compare(0, 5, "root ") == 0)
+                roots_.push_back(unescapeField(line.substr(5)));
+        }
+        if (line != "files" || algorithm_.empty())
+            throw std::runtime_error("incomplete shard header: " + path);
+    }
+
+    const std::string& path() const { return path_; }
+    const std::string& algorithm() const { return algorithm_; }
+    const std::vector<std::string>& roots() const { return roots_; }
+
+    bool next(FileRecord& record) {
+        std::string line;
+        if (!std::getline(in_, line))
+            return false;
+        std::vector<std::string> fields;
+        std::istringstream ls(line);
+        std::string field;
+        while (std::getline(ls, field, '\t'))
+            fields.push_back(field);
+        if (fields.size() != 11)
+            throw std::runtime_error("malformed record in shard " + path_ + ": " + line);
+        record = FileRecord();
+        FileFingerprint &fp = record.fingerprint;
+        fp.size = (off_t)std::stoll(fields[0]);
+        fp.device = (dev_t)std::stoull(fields[1]);
+        fp.inode = (ino_t)std::stoull(fields[2]);
+        fp.mtime.tv_sec = (time_t)std::stoll(fields[3]);
+        fp.mtime.tv_nsec = std::stol(fields[4]);
+        fp.ctime.tv_sec = (time_t)std::stoll(fields[5]);
+        fp.ctime.tv_nsec = std::stol(fields[6]);
+        record.archive_member = fields[7] == "1";
+        if (fields[8] != "-")
+            record.digests().partial_hash = fields[8];
+        if (fields[9] != "-")
+            record.digests().hash = fields[9];
+        record.path = unescapeField(fields[10]);
+        if (fp.size < last_size_)
+            throw std::runtime_error("shard is not sorted by size: " + path_);
+        last_size_ = fp.size;
+        return true;
+    }
+
+private:
+    std::string path_;
+    std::ifstream in_;
+    std::string algorithm_;
+    std::vector<std::string> roots_;
+    off_t last_size_ = 0;
+};
+
+// ------------------------------------------------------------------------------------
+// Function: mergeShards
+// k-way merges size-sorted shards. Only sizes that occur more than once across all
+// shards are kept. Buckets drawn from more than one shard are then confirmed together,
+// for the files a shard left unhashed; a bucket from a single shard was already
+// confirmed by that shard's scan and is kept as is.
+// Returns the number of duplicate groups that span more than one shard.
+// ------------------------------------------------------------------------------------
+int mergeShards(std::vector<ShardReader>& shards, const std::string& algorithm, StagePlanner& planner,
+                DigestStore& digests, std::vector<FileRecord>& records, int& hashed_files) {
+    typedef std::pair<off_t, size_t> Head;  // (size of current record, shard index)
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heap;
+    std::vector<FileRecord> current(shards.size());
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (shards[i].next(current[i]))
+            heap.push({current[i].fingerprint.size, i});
+    }
+
+    std::vector<FileRecord> candidates;
+    std::vector<size_t> candidate_shard;
+    std::vector<std::vector<size_t>> buckets;
+    while (!heap.empty()) {
+        off_t size = heap.top().first;
+        std::vector<size_t> bucket;
+        while (!heap.empty() && heap.top().first == size) {
+            size_t i = heap.top().second;
+            heap.pop();
+            bucket.push_back(candidates.size());
+            candidates.push_back(std::move(current[i]));
+            candidate_shard.push_back(i);
+            current[i] = FileRecord();
+            if (shards[i].next(current[i]))
+                heap.push({current[i].fingerprint.size, i});
+        }
+        if (bucket.size() < 2) {
+            candidates.pop_back();
+            candidate_shard.pop_back();
+            continue;
+        }
+        size_t first_shard = candidate_shard[bucket.front()];
+        if (std::any_of(bucket.begin(), bucket.end(),
+                        [&](size_t index) { return candidate_shard[index] != first_shard; }))
+            buckets.push_back(std::move(bucket));
+    }
+
+    // Size collisions across shards: confirm what the shards did not, reusing their
+    // partial hashes where the planner probes
+    auto countUnhashed = [&]() {
+        return (int)std::count_if(candidates.begin(), candidates.end(),
+                                  [](const FileRecord &r) { return r.hash().empty(); });
+    };
+    int unhashed = countUnhashed();
+    confirmBuckets(candidates, buckets, planner, algorithm, false, true);
+    hashed_files += unhashed - countUnhashed();
+
+    int cross_shard_groups = 0;
+    for (const auto &bucket : buckets) {
+        std::map<std::string, std::set<size_t>> shards_per_hash;
+        for (size_t index : bucket) {
+            if (!candidates[index].hash().empty())
+                shards_per_hash[candidates[index].hash()].insert(candidate_shard[index]);
+        }
+        for (const auto &[hash, shard_set] : shards_per_hash) {
+            if (shard_set.size() > 1)
+                cross_shard_groups++;
+        }
+    }
+    for (auto &record : candidates) {
+        if (!record.hash().empty()) {
+            digests.compact(record);
+            records.push_back(std::move(record));
+        }
+    }
+    return cross_shard_groups;
+}
+
+enum VerifyOutcome { VERIFY_OK, VERIFY_CORRUPT, VERIFY_MODIFIED, VERIFY_UNREADABLE };
+
+struct VerifyResult {
+    VerifyOutcome outcome = VERIFY_UNREADABLE;
+    std::string hash;
+};
+
+// ------------------------------------------------------------------------------------
+// Function: verifyRecords
+// Re-hashes the cataloged files whose size and mtime are unchanged and compares them
+// with the stored digests. Reading goes through hashRecords, so every device is read
+// as its I/O profile says (on HDDs one file at a time in physical order), here at idle
+// I/O priority and optionally capped at max_rate bytes per second per device.
+// ------------------------------------------------------------------------------------
+std::vector<VerifyResult> verifyRecords(const std::vector<FileRecord>& records, const std::string& algorithm,
+                                        double max_rate, bool show_progress) {
+    std::vector<VerifyResult> results(records.size());
+    auto unchanged = [](const FileFingerprint &now, const FileFingerprint &cataloged) {
+        return now.size == cataloged.size &&
+               now.mtime.tv_sec == cataloged.mtime.tv_sec &&
+               now.mtime.tv_nsec == cataloged.mtime.tv_nsec;
+    };
+    std::vector<FileRecord> current(records.size());
+    std::vector<size_t> to_hash;
+    for (size_t i = 0; i < records.size(); i++) {
+        current[i].path = records[i].path;
+        if (!getFingerprint(records[i].path, current[i].fingerprint))
+            continue;
+        if (!unchanged(current[i].fingerprint, records[i].fingerprint)) {
+            results[i].outcome = VERIFY_MODIFIED;
+            continue;
+        }
+        to_hash.push_back(i);
+    }
+
+    ReadPacing pacing;
+    pacing.idle_priority = true;
+    pacing.max_rate = max_rate;
+    std::vector<FileRecord> no_members;
+    hashRecords(current, to_hash, algorithm, false, show_progress, no_members, false, nullptr, pacing);
+    for (size_t i : to_hash) {
+        results[i].hash = current[i].hash();
+        if (!unchanged(current[i].fingerprint, records[i].fingerprint))
+            results[i].outcome = VERIFY_MODIFIED;
+        else if (!current[i].hash().empty())
+            results[i].outcome = current[i].hash() == records[i].hash() ? VERIFY_OK : VERIFY_CORRUPT;
+    }
+    return results;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: selectRollingSlice
+// Picks the next percent (by bytes) of the verifiable records, starting at the cursor
+// saved by the previous run and wrapping around. Sets next_cursor to where the next
+// run starts; the caller saves it with saveRollingCursor once the slice is verified,
+// so a run that is killed verifies the same slice again next time.
+// ------------------------------------------------------------------------------------
+std::vector<size_t> selectRollingSlice(const std::vector<FileRecord>& records, double percent,
+                                       const std::string& cursorfile, size_t& next_cursor) {
+    std::vector<size_t> slice;
+    next_cursor = 0;
+    if (records.empty())
+        return slice;
+    if (percent >= 100) {
+        for (size_t i = 0; i < records.size(); i++)
+            slice.push_back(i);
+        return slice;
+    }
+
+    double total_bytes = 0;
+    for (const auto &record : records)
+        total_bytes += record.fingerprint.size;
+    size_t cursor = 0;
+    std::ifstream in(cursorfile);
+    in >> cursor;
+    cursor %= records.size();
+
+    double budget = total_bytes * percent / 100.0;
+    double bytes = 0;
+    while (slice.size() < records.size() && (slice.empty() || bytes < budget)) {
+        slice.push_back(cursor);
+        bytes += records[cursor].fingerprint.size;
+        cursor = (cursor + 1) % records.size();
+    }
+    next_cursor = cursor;
+    return slice;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: saveRollingCursor
+// Saves where the next rolling verify run starts (see selectRollingSlice)
+// ------------------------------------------------------------------------------------
+void saveRollingCursor(const std::string& cursorfile, size_t cursor) {
+    std::ofstream out(cursorfile);
+    out << cursor << "\n";
+    if (!out)
+        errorLog.add("Cannot save cursor", cursorfile, std::strerror(errno));
+}
+
+// ------------------------------------------------------------------------------------
+// Class: DeleteScope
+// The set of places duplicates may be deleted from, compiled into one trie over path
+// components. Plain directories become chains of literal edges (hash lookups) and
+// glob patterns add wildcard edges. A node indexes its wildcard edges by their
+// longest literal run: prefix ("cache" for "cache*"), suffix (".bak" for "*.bak") or,
+// failing both, a run inside ("tmp" for "*tmp*"). A component is then fnmatch'ed only
+// against globs whose run it contains, found by hash lookups of its own prefixes,
+// suffixes and substrings up to the longest indexed run. Checking a file walks its
+// path once, at a cost that grows with path depth and component length, not with
+// the number of entries; only globs without any literal character (such as "*" or
+// "?*") are tried one by one. A file is in scope if it or any parent directory
+// matches an entry. In patterns "*", "?" and
+// "[...]" match within one component, "**" matches any number of components, and a
+// pattern not starting with "/" may match at any depth.
+// ------------------------------------------------------------------------------------
+class DeleteScope {
+public:
+    void addDirectory(const std::string& directory) {
+        std::error_code ec;
+        std::filesystem::path dir = std::filesystem::weakly_canonical(std::filesystem::absolute(directory), ec);
+        if (ec) {
+            errorLog.add("Invalid delete scope", directory, ec.message());
+            return;
+        }
+        insert(split(dir.string()));
+    }
+
+    void addPattern(const std::string& pattern) {
+        std::vector<std::string> components = split(pattern);
+        if (pattern[0] != '/')
+            components.insert(components.begin(), "**");
+        insert(components);
+    }
+
+    // One entry per line: a directory, or a glob if it contains *, ? or [.
+    // Blank lines and lines starting with # are ignored.
+    bool load(const std::string& scopefile) {
+        std::ifstream in(scopefile);
+        if (!in)
+            return false;
+        std::string line;
+        while (std::getline(in, line)) {
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+                line.pop_back();
+            if (line.empty() || line[0] == '#')
+                continue;
+            if (line.find_first_of("*?[") != std::string::npos)
+                addPattern(line);
+            else
+                addDirectory(line);
+        }
+        return true;
+    }
+
+    size_t size() const { return entries_; }
+
+    bool matches(const std::string& path) const {
+        std::vector<size_t> active, next;
+        enter(active, 0);
+        size_t start = 0;
+        while (true) {
+            for (size_t n : active) {
+                if (nodes_[n].terminal)
+                    return true;
+            }
+            size_t end = path.find('/', start);
+            std::string component = path.substr(start, end == std::string::npos ? std::string::npos : end - start);
+            if (!component.empty()) {
+                next.clear();
+                for (size_t n : active) {
+                    const Node &node = nodes_[n];
+                    if (node.any_depth)
+                        enter(next, n);
+                    auto it = node.literal.find(component);
+                    if (it != node.literal.end())
+                        enter(next, it->second);
+                    if (!node.wildcard.empty())
+                        matchWildcards(node, component, next);
+                }
+                std::sort(next.begin(), next.end());
+                next.erase(std::unique(next.begin(), next.end()), next.end());
+                active.swap(next);
+                if (active.empty())
+                    return false;
+            }
+            if (end == std::string::npos)
+                break;
+            start = end + 1;
+        }
+        for (size_t n : active) {
+            if (nodes_[n].terminal)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    static constexpr size_t NONE = std::numeric_limits<size_t>::max();
+
+    struct Node {
+        std::unordered_map<std::string, size_t> literal;
+        std::vector<std::pair<std::string, size_t>> wildcard;
+        // Positions in wildcard by their longest literal run, and those without any
+        std::unordered_map<std::string, std::vector<size_t>> wildcard_by_prefix, wildcard_by_suffix, wildcard_by_infix;
+        std::vector<size_t> wildcard_unanchored;
+        size_t longest_prefix = 0, longest_suffix = 0, longest_infix = 0;
+        size_t any_depth_child = NONE;  // "**" edge
+        bool any_depth = false;         // this node is a "**" and loops on every component
+        bool terminal = false;
+    };
+
+    static std::vector<std::string> split(const std::string& path) {
+        std::vector<std::string> components;
+        std::istringstream ss(path);
+        std::string component;
+        while (std::getline(ss, component, '/')) {
+            if (!component.empty() && component != ".")
+                components.push_back(component);
+        }
+        return components;
+    }
+
+    void insert(const std::vector<std::string>& components) {
+        size_t n = 0;
+        for (const auto &component : components) {
+            size_t child = NONE;
+            if (component == "**") {
+                if (nodes_[n].any_depth_child == NONE) {
+                    nodes_.emplace_back();
+                    nodes_.back().any_depth = true;
+                    nodes_[n].any_depth_child = nodes_.size() - 1;
+                }
+                child = nodes_[n].any_depth_child;
+            } else if (component.find_first_of("*?[") != std::string::npos) {
+                for (const auto &edge : nodes_[n].wildcard) {
+                    if (edge.first == component)
+                        child = edge.second;
+                }
+                if (child == NONE) {
+                    nodes_.emplace_back();
+                    child = nodes_.size() - 1;
+                    indexWildcard(nodes_[n], component, child);
+                }
+            } else {
+                auto it = nodes_[n].literal.find(component);
+                if (it == nodes_[n].literal.end()) {
+                    nodes_.emplace_back();
+                    child = nodes_.size() - 1;
+                    nodes_[n].literal.emplace(component, child);
+                } else {
+                    child = it->second;
+                }
+            }
+            n = child;
+        }
+        nodes_[n].terminal = true;
+        entries_++;
+    }
+
+    // Splits a glob into the literal runs between its wildcards ("*", "?" and bracket
+    // expressions); the first run is its literal prefix, the last its literal suffix
+    static std::vector<std::string> literalRuns(const std::string& glob) {
+        std::vector<std::string> runs(1);
+        for (size_t i = 0; i < glob.size(); i++) {
+            char c = glob[i];
+            if (c == '\\' && i + 1 < glob.size()) {
+                runs.back() += glob[++i];
+            } else if (c == '*' || c == '?') {
+                runs.emplace_back();
+            } else if (c == '[') {
+                // A "]" right after "[" or "[!" is a member; "[:class:]" may hold one too
+                size_t j = i + 1;
+                if (j < glob.size() && (glob[j] == '!' || glob[j] == '^'))
+                    j++;
+                if (j < glob.size() && glob[j] == ']')
+                    j++;
+                while (j < glob.size() && glob[j] != ']') {
+                    if (glob[j] == '[' && j + 1 < glob.size() && std::strchr(":.=", glob[j + 1])) {
+                        size_t close = glob.find(std::string(1, glob[j + 1]) + "]", j + 2);
+                        j = close == std::string::npos ? glob.size() : close + 2;
+                    } else {
+                        j++;
+                    }
+                }
+                if (j >= glob.size()) {
+                    runs.back() += c;  // unterminated: fnmatch takes "[" literally
+                } else {
+                    runs.emplace_back();
+                    i = j;
+                }
+            } else {
+                runs.back() += c;
+            }
+        }
+        return runs;
+    }
+
+    // Adds a wildcard edge, indexed by its longest literal run: by prefix or suffix if
+    // that is the longest, else by the longest run inside the glob
+    static void indexWildcard(Node& node, const std::string& glob, size_t child) {
+        size_t position = node.wildcard.size();
+        node.wildcard.emplace_back(glob, child);
+        std::vector<std::string> runs = literalRuns(glob);
+        const std::string &prefix = runs.front(), &suffix = runs.back();
+        std::string infix;
+        for (size_t r = 1; r + 1 < runs.size(); r++) {
+            if (runs[r].size() > infix.size())
+                infix = runs[r];
+        }
+        if (!prefix.empty() && prefix.size() >= std::max(suffix.size(), infix.size())) {
+            node.wildcard_by_prefix[prefix].push_back(position);
+            node.longest_prefix = std::max(node.longest_prefix, prefix.size());
+        } else if (!suffix.empty() && suffix.size() >= infix.size()) {
+            node.wildcard_by_suffix[suffix].push_back(position);
+            node.longest_suffix = std::max(node.longest_suffix, suffix.size());
+        } else if (!infix.empty()) {
+            node.wildcard_by_infix[infix].push_back(position);
+            node.longest_infix = std::max(node.longest_infix, infix.size());
+        } else {
+            node.wildcard_unanchored.push_back(position);
+        }
+    }
+
+    // Enters the children of the node's wildcard edges that match the component
+    void matchWildcards(const Node& node, const std::string& component, std::vector<size_t>& next) const {
+        auto tryEdges = [&](const std::vector<size_t> &positions) {
+            for (size_t position : positions) {
+                const auto &edge = node.wildcard[position];
+                if (fnmatch(edge.first.c_str(), component.c_str(), 0) == 0)
+                    enter(next, edge.second);
+            }
+        };
+        auto lookup = [&](const std::unordered_map<std::string, std::vector<size_t>> &index, size_t start, size_t len) {
+            auto it = index.find(component.substr(start, len));
+            if (it != index.end())
+                tryEdges(it->second);
+        };
+        for (size_t len = 1; len <= std::min(component.size(), node.longest_prefix); len++)
+            lookup(node.wildcard_by_prefix, 0, len);
+        for (size_t len = 1; len <= std::min(component.size(), node.longest_suffix); len++)
+            lookup(node.wildcard_by_suffix, component.size() - len, len);
+        for (size_t start = 0; node.longest_infix > 0 && start < component.size(); start++) {
+            for (size_t len = 1; len <= std::min(component.size() - start, node.longest_infix); len++)
+                lookup(node.wildcard_by_infix, start, len);
+        }
+        tryEdges(node.wildcard_unanchored);
+    }
+
+    // Adds a node to the active set, along with the "**" it may skip into (zero components)
+    void enter(std::vector<size_t>& active, size_t n) const {
+        active.push_back(n);
+        if (nodes_[n].any_depth_child != NONE)
+            enter(active, nodes_[n].any_depth_child);
+    }
+
+    std::vector<Node> nodes_ = std::vector<Node>(1);
+    size_t entries_ = 0;
+};
 
 // ------------------------------------------------------------------------------------
-// Function: getCurrentDateTime
-// Retrieves the current date and time in the format YYYYMMDDHHMMSS
+// Struct: PendingGroup
+// A duplicate group waiting for a manual decision: its in-scope files and the
+// fingerprints they were hashed with
 // ------------------------------------------------------------------------------------
-std::string getCurrentDateTime() {
-    std::time_t now = std::time(nullptr);
-    std::tm *ltm = std::localtime(&now);
-    char buf[16];
-    std::strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", ltm);
-    return std::string(buf);
-}
+struct PendingGroup {
+    std::string hash;
+    std::string duplicates;
+    std::vector<std::string> files_to_delete;
+    std::unordered_map<std::string, FileFingerprint> fingerprints;
+    uint64_t reclaimable = 0;
+};
 
 // ------------------------------------------------------------------------------------
-// Function: formatDuration
-// Formats a given duration (in seconds) into the format h,mm,ss
+// Struct: DecisionCluster
+// Pending groups whose in-scope files live in the same set of directories, so one
+// answer ("keep the copy in this directory") fits all of them
 // ------------------------------------------------------------------------------------
-std::string formatDuration(int seconds) {
-    int h = seconds / 3600;
-    int m = (seconds % 3600) / 60;
-    int s = seconds % 60;
-    std::ostringstream oss;
-    oss << h << "h," << std::setfill('0') << std::setw(2) << m << "m," << std::setw(2) << s << "s";
-    return oss.str();
+struct DecisionCluster {
+    std::vector<std::string> directories;
+    std::vector<size_t> groups;
+    uint64_t reclaimable = 0;
+};
+
+// ------------------------------------------------------------------------------------
+// Function: clusterPendingGroups
+// Clusters pending groups by the directories of their files, largest reclaimable
+// total first
+// ------------------------------------------------------------------------------------
+std::vector<DecisionCluster> clusterPendingGroups(const std::vector<PendingGroup>& pending) {
+    std::map<std::vector<std::string>, DecisionCluster> by_directories;
+    for (size_t g = 0; g < pending.size(); g++) {
+        std::vector<std::string> directories;
+        for (const auto &file : pending[g].files_to_delete)
+            directories.push_back(std::filesystem::path(file).parent_path().string());
+        std::sort(directories.begin(), directories.end());
+        directories.erase(std::unique(directories.begin(), directories.end()), directories.end());
+        DecisionCluster &cluster = by_directories[directories];
+        cluster.directories = directories;
+        cluster.groups.push_back(g);
+        cluster.reclaimable += pending[g].reclaimable;
+    }
+    std::vector<DecisionCluster> clusters;
+    for (auto &entry : by_directories)
+        clusters.push_back(std::move(entry.second));
+    std::stable_sort(clusters.begin(), clusters.end(), [](const DecisionCluster &a, const DecisionCluster &b) {
+        return a.reclaimable > b.reclaimable;
+    });
+    return clusters;
 }
 
 // ------------------------------------------------------------------------------------
-// Function: getHash
-// Calculates the hash of a file based on the given algorithm (MD5 or SHA-256)
+// Function: keepOneOf
+// Keeps files_to_delete[keep_index - 1] and deletes the other in-scope copies of the
+// group (keep_index 0 skips the group). Returns the number of files deleted.
 // ------------------------------------------------------------------------------------
-std::string getHash(const std::string& filepath, const std::string& algorithm = "MD5") {
-    std::string output;
-    std::ifstream file(filepath, std::ios::binary);
-    if (!file) {
-        std::cerr << "Cannot open file: " << filepath << std::endl;
-        return "";
+int keepOneOf(const PendingGroup& group, int keep_index, bool dry_run, std::ofstream& logFile) {
+    const std::vector<std::string> &files_to_delete = group.files_to_delete;
+    const std::string &hash = group.hash;
+    const std::string &duplicates = group.duplicates;
+    int deleted = 0;
+    if (keep_index <= 0 || keep_index > (int)files_to_delete.size()) {
+        // If 0 or invalid input, skip deletion for this group
+        for (const auto &file : files_to_delete) {
+            logFile << "Skipped " << file 
+                    << " (Hash: " << hash 
+                    << ", Duplicates: " << duplicates << ")\n";
+        }
+    } else if (!isUnchanged(files_to_delete[keep_index - 1], group.fingerprints)) {
+        // Never delete copies when the file to keep no longer matches its hash
+        for (const auto &file : files_to_delete) {
+            logFile << "Changed since hashing, skipped " << file 
+                    << " (Hash: " << hash 
+                    << ", Duplicates: " << duplicates << ")\n";
+        }
+    } else {
+        // Delete all files except the one selected by the user (and never that file
+        // again, should it be listed twice or under another hard link)
+        for (size_t i = 0; i < files_to_delete.size(); i++) {
+            if ((int)i == keep_index - 1) {
+                logFile << "Kept " << files_to_delete[i] 
+                        << " (Hash: " << hash 
+                        << ", Duplicates: " << duplicates << ")\n";
+                continue;
+            }
+            if (isSameFile(files_to_delete[i], files_to_delete[keep_index - 1], group.fingerprints)) {
+                logFile << "Same file as the kept copy, skipped " << files_to_delete[i]
+                        << " (Hash: " << hash
+                        << ", Duplicates: " << duplicates << ")\n";
+                continue;
+            }
+            if (!isUnchanged(files_to_delete[i], group.fingerprints)) {
+                logFile << "Changed since hashing, skipped " << files_to_delete[i] 
+                        << " (Hash: " << hash 
+                        << ", Duplicates: " << duplicates << ")\n";
+                continue;
+            }
+            if (removeDuplicate(files_to_delete[i], hash, duplicates, dry_run, logFile))
+                deleted++;
+        }
     }
-    try {
-        if (algorithm == "MD5") {
-            CryptoPP::Weak::MD5 hash;
-            CryptoPP::FileSource fs(file, true, new CryptoPP::HashFilter(hash,
-                new CryptoPP::HexEncoder(new CryptoPP::StringSink(output))));
-        } else if (algorithm == "SHA-256") {
-            CryptoPP::SHA256 hash;
-            CryptoPP::FileSource fs(file, true, new CryptoPP::HashFilter(hash,
-                new CryptoPP::HexEncoder(new CryptoPP::StringSink(output))));
-        } else {
-            std::cerr << "Invalid hash algorithm: " << algorithm << std::endl;
-            return "";
+    return deleted;
+}
+
+// ------------------------------------------------------------------------------------
+// Function: reviewPendingGroups
+// Manual mode: asks once per directory cluster instead of once per group. The answer
+// is a directory number (keep the copy there in every group of the cluster), 0 to
+// skip the cluster, "e" to decide each group separately, or a path such as /data,
+// which keeps the copy under that path in this and every later cluster where
+// exactly one of its directories lies under it. Returns the number of files deleted.
+// ------------------------------------------------------------------------------------
+int reviewPendingGroups(const std::vector<PendingGroup>& pending, bool dry_run, std::ofstream& logFile) {
+    std::vector<DecisionCluster> clusters = clusterPendingGroups(pending);
+    std::vector<std::string> keep_rules;
+    auto isUnder = [](const std::string &directory, const std::string &prefix) {
+        return directory == prefix || (directory.compare(0, prefix.size(), prefix) == 0 &&
+                                       (prefix.back() == '/' || directory[prefix.size()] == '/'));
+    };
+    // Index (1-based) of the only cluster directory under the rule, 0 if none or several
+    auto ruleChoice = [&](const DecisionCluster &cluster, const std::string &rule) {
+        int choice = 0;
+        if (cluster.directories.size() < 2)
+            return 0;
+        for (size_t d = 0; d < cluster.directories.size(); d++) {
+            if (isUnder(cluster.directories[d], rule)) {
+                if (choice != 0)
+                    return 0;
+                choice = (int)d + 1;
+            }
+        }
+        return choice;
+    };
+
+    int deleted = 0;
+    for (size_t c = 0; c < clusters.size(); c++) {
+        const DecisionCluster &cluster = clusters[c];
+        int choice = 0;
+        bool each_group = false;
+        for (const auto &rule : keep_rules) {
+            choice = ruleChoice(cluster, rule);
+            if (choice != 0) {
+                logFile << "Keeping copies under " << rule << " for " << cluster.groups.size()
+                        << " groups in " << cluster.directories[choice - 1] << "\n";
+                break;
+            }
+        }
+        while (choice == 0 && !each_group) {
+            std::cout << "\nCluster " << c + 1 << "/" << clusters.size() << ": " << cluster.groups.size()
+                      << " duplicate groups, " << formatBytes(cluster.reclaimable) << " reclaimable, in:\n";
+            for (size_t d = 0; d < cluster.directories.size(); d++) {
+                std::cout << d + 1 << ") " << cluster.directories[d] << "\n";
+            }
+            std::cout << "Select the directory whose copies to KEEP in all these groups, 0 to skip,\n"
+                      << "'e' to decide each group, or a path to always keep copies under it: ";
+            std::string answer;
+            if (!std::getline(std::cin, answer))
+                break;
+            if (answer == "e" || answer == "E") {
+                each_group = true;
+            } else if (!answer.empty() && answer[0] == '/') {
+                while (answer.size() > 1 && answer.back() == '/')
+                    answer.pop_back();
+                keep_rules.push_back(answer);
+                choice = ruleChoice(cluster, answer);
+                if (choice == 0)
+                    std::cout << "Rule saved, but it does not select exactly one directory of this cluster.\n";
+            } else {
+                try {
+                    choice = std::stoi(answer);
+                } catch (const std::exception &e) {
+                    choice = -1;
+                }
+                if (choice == 0)
+                    break;
+                if (choice < 0 || choice > (int)cluster.directories.size()) {
+                    std::cerr << "Invalid input: " << answer << std::endl;
+                    choice = 0;
+                }
+            }
+        }
+
+        for (size_t g : cluster.groups) {
+            const PendingGroup &group = pending[g];
+            int keep_index = 0;
+            if (each_group) {
+                std::cout << "\nFound duplicates with hash " << group.hash << " in selected directories:\n";
+                for (size_t i = 0; i < group.files_to_delete.size(); i++) {
+                    std::cout << i + 1 << ") " << group.files_to_delete[i] << "\n";
+                }
+                std::cout << "Please select the file number to KEEP (others will be deleted), or 0 to skip deletion: ";
+                std::cin >> keep_index;
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            } else if (choice > 0) {
+                // The first copy in the chosen directory is kept
+                for (size_t i = 0; i < group.files_to_delete.size() && keep_index == 0; i++) {
+                    if (std::filesystem::path(group.files_to_delete[i]).parent_path() == cluster.directories[choice - 1])
+                        keep_index = (int)i + 1;
+                }
+            }
+            deleted += keepOneOf(group, keep_index, dry_run, logFile);
         }
-    } catch (const std::exception &e) {
-        std::cerr << "Hash error for file " << filepath << ": " << e.what() << std::endl;
-        return "";
     }
-    return output;
+    return deleted;
 }
 
 // ------------------------------------------------------------------------------------
-// Function: isPathInDirectory
-// Checks whether the given file path is located within the specified directory
+// Function: cloneFile
+// Creates `target` sharing content with the existing file `existing`: a reflink
+// (FICLONE, a new inode sharing extents) or a hard link. Reflinks are written under a
+// temporary name and get the source's mode and times. Returns 0 or an errno value.
 // ------------------------------------------------------------------------------------
-bool isPathInDirectory(const std::string& filePath, const std::string& directory) {
-    try {
-        std::filesystem::path fileP = std::filesystem::canonical(filePath);
-        std::filesystem::path dirP = std::filesystem::canonical(directory);
-        auto relPath = std::filesystem::relative(fileP, dirP);
-        return !relPath.empty() && relPath.string().find("..") == std::string::npos;
-    } catch (const std::exception &e) {
-        std::cerr << "Error comparing paths: " << e.what() << std::endl;
-        return false;
+int cloneFile(const std::string& existing, const std::string& target, bool hard_link, const struct stat& source) {
+    if (hard_link)
+        return link(existing.c_str(), target.c_str()) == 0 ? 0 : errno;
+    std::string tmpfile = target + ".mydupefinder-tmp";
+    int in = open(existing.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return errno;
+    int out = open(tmpfile.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, source.st_mode & 07777);
+    if (out < 0) {
+        int error = errno;
+        close(in);
+        return error;
+    }
+    int error = 0;
+    struct timespec times[2] = {source.st_atim, source.st_mtim};
+    if (ioctl(out, FICLONE, in) != 0 || futimens(out, times) != 0)
+        error = errno;
+    close(in);
+    if (close(out) != 0 && error == 0)
+        error = errno;
+    if (error == 0 && rename(tmpfile.c_str(), target.c_str()) != 0)
+        error = errno;
+    if (error != 0)
+        unlink(tmpfile.c_str());
+    return error;
+}
+
+// ------------------------------------------------------------------------------------
+// Struct: IngestStats
+// What an ingest did: files linked to existing content, files copied, targets that
+// already existed, and the bytes behind each; directories and symlinks recreated,
+// and special files skipped
+// ------------------------------------------------------------------------------------
+struct IngestStats {
+    int linked = 0;
+    int copied = 0;
+    int existing = 0;
+    int failed = 0;
+    int directories = 0;
+    int symlinks = 0;
+    int skipped = 0;
+    uint64_t linked_bytes = 0;
+    uint64_t copied_bytes = 0;
+};
+
+// ------------------------------------------------------------------------------------
+// Function: ingestTree
+// Copies the tree `src` into `dst`, but every file whose content already exists on
+// the destination filesystem (in `index`) becomes a reflink or hard link to that copy
+// instead. Only sizes present in the index are hashed, and index entries are hashed
+// on demand; files copied by the ingest join the index, so repeats inside `src` are
+// linked too. link_mode is "auto" (reflink, else hard link), "reflink" or "hard".
+// Directories (also empty ones) are recreated with their mode and times, and symlinks
+// as symlinks with the same target; FIFOs, sockets and device nodes are logged and
+// skipped. Existing targets are never overwritten.
+// ------------------------------------------------------------------------------------
+IngestStats ingestTree(const std::string& src, const std::string& dst, std::vector<FileRecord>& index,
+                       const std::string& algorithm, const std::string& link_mode, std::ofstream& logFile) {
+    IngestStats stats;
+    std::vector<FileRecord> sources;
+    TreeEntries extras;
+    collectFiles({src}, sources, &extras);
+    std::sort(sources.begin(), sources.end(), [](const FileRecord &a, const FileRecord &b) { return a.path < b.path; });
+    std::sort(extras.directories.begin(), extras.directories.end());
+    std::filesystem::path src_root = std::filesystem::canonical(src);
+    std::filesystem::path dst_root = std::filesystem::canonical(dst);
+    struct stat dst_st;
+    stat(dst_root.c_str(), &dst_st);
+    auto targetOf = [&](const std::string &path) {
+        return dst_root / std::filesystem::path(path).lexically_relative(src_root);
+    };
+
+    // Directories first, so that empty ones exist too; mode and times are set last,
+    // as adding entries changes them and a read-only mode would block the ingest
+    std::vector<std::pair<std::string, std::filesystem::path>> created_directories;
+    for (const auto &directory : extras.directories) {
+        std::filesystem::path target = targetOf(directory);
+        std::error_code ec;
+        if (std::filesystem::exists(std::filesystem::symlink_status(target, ec)))
+            continue;
+        std::filesystem::create_directories(target, ec);
+        if (ec) {
+            errorLog.add("Cannot create directory", target.string(), ec.message());
+            stats.failed++;
+            continue;
+        }
+        created_directories.emplace_back(directory, target);
+        stats.directories++;
+    }
+
+    for (const auto &link : extras.symlinks) {
+        std::filesystem::path target = targetOf(link);
+        std::error_code ec;
+        if (std::filesystem::exists(std::filesystem::symlink_status(target, ec))) {
+            logFile << "Exists, skipped " << target.string() << "\n";
+            stats.existing++;
+            continue;
+        }
+        std::filesystem::path link_target = std::filesystem::read_symlink(link, ec);
+        if (!ec)
+            std::filesystem::create_directories(target.parent_path(), ec);
+        if (!ec)
+            std::filesystem::create_symlink(link_target, target, ec);
+        struct stat link_st;
+        if (!ec && lstat(link.c_str(), &link_st) == 0) {
+            struct timespec times[2] = {link_st.st_atim, link_st.st_mtim};
+            utimensat(AT_FDCWD, target.c_str(), times, AT_SYMLINK_NOFOLLOW);
+        }
+        if (ec) {
+            errorLog.add("Cannot create symlink", target.string(), ec.message());
+            stats.failed++;
+            continue;
+        }
+        logFile << "Symlinked " << target.string() << " -> " << link_target.string() << "\n";
+        stats.symlinks++;
+    }
+
+    for (const auto &other : extras.others) {
+        logFile << "Special file, skipped " << other << "\n";
+        stats.skipped++;
+    }
+
+    // Only content on the destination filesystem can be linked to
+    std::unordered_map<off_t, std::vector<size_t>> by_size;
+    for (size_t i = 0; i < index.size(); i++) {
+        if (index[i].fingerprint.device == dst_st.st_dev && !index[i].archive_member && index[i].fingerprint.size > 0)
+            by_size[index[i].fingerprint.size].push_back(i);
+    }
+    // Hash of an index entry, (re)computed if missing or if the file changed since indexing
+    auto indexHash = [&](FileRecord &entry) {
+        FileFingerprint now;
+        if (!getFingerprint(entry.path, now))
+            return std::string();
+        if (now != entry.fingerprint || entry.hash().empty() || entry.hash().compare(0, 6, "BYTES-") == 0) {
+            std::vector<ArchiveMember> no_members;
+            if (!hashStableFile(entry.path, algorithm, false, entry.digests().hash, no_members, entry.fingerprint))
+                entry.digests().hash.clear();
+        }
+        return entry.hash();
+    };
+
+    for (const auto &source : sources) {
+        std::filesystem::path target = targetOf(source.path);
+        std::error_code ec;
+        if (std::filesystem::exists(std::filesystem::symlink_status(target, ec))) {
+            logFile << "Exists, skipped " << target.string() << "\n";
+            stats.existing++;
+            continue;
+        }
+        std::filesystem::create_directories(target.parent_path(), ec);
+        if (ec) {
+            errorLog.add("Cannot create directory", target.parent_path().string(), ec.message());
+            stats.failed++;
+            continue;
+        }
+        struct stat source_st;
+        if (stat(source.path.c_str(), &source_st) != 0) {
+            errorLog.add("Cannot stat file", source.path, std::strerror(errno));
+            stats.failed++;
+            continue;
+        }
+
+        // Known content: link to the existing copy
+        std::string hash;
+        auto candidates = by_size.find(source.fingerprint.size);
+        if (candidates != by_size.end()) {
+            FileFingerprint fingerprint;
+            std::vector<ArchiveMember> no_members;
+            if (!hashStableFile(source.path, algorithm, false, hash, no_members, fingerprint))
+                hash.clear();
+            for (size_t i = 0; !hash.empty() && i < candidates->second.size(); i++) {
+                FileRecord &entry = index[candidates->second[i]];
+                if (indexHash(entry) != hash)
+                    continue;
+                int error = EXDEV;
+                const char *how = "";
+                if (link_mode != "hard") {
+                    error = cloneFile(entry.path, target.string(), false, source_st);
+                    how = "reflink";
+                }
+                if (error != 0 && link_mode != "reflink") {
+                    error = cloneFile(entry.path, target.string(), true, source_st);
+                    how = "hard link";
+                }
+                if (error == 0) {
+                    logFile << "Linked " << target.string() << " to " << entry.path
+                            << " (" << how << ", Hash: " << hash << ")\n";
+                    stats.linked++;
+                    stats.linked_bytes += source.fingerprint.size;
+                    break;
+                }
+                if (error != EXDEV && error != EOPNOTSUPP && error != EINVAL && error != ENOTTY && error != EMLINK)
+                    errorLog.add("Cannot link", target.string(), std::strerror(error));
+            }
+            if (std::filesystem::exists(std::filesystem::symlink_status(target, ec)))
+                continue;
+        }
+
+        // New content: copy it under a temporary name, then make it linkable
+        std::string tmpfile = target.string() + ".mydupefinder-tmp";
+        std::filesystem::copy_file(source.path, tmpfile, ec);
+        struct timespec times[2] = {source_st.st_atim, source_st.st_mtim};
+        if (!ec && utimensat(AT_FDCWD, tmpfile.c_str(), times, 0) != 0)
+            ec = std::error_code(errno, std::generic_category());
+        if (!ec)
+            std::filesystem::rename(tmpfile, target, ec);
+        if (ec) {
+            std::error_code ignored;
+            std::filesystem::remove(tmpfile, ignored);
+            errorLog.add("Cannot copy", source.path, ec.message());
+            stats.failed++;
+            continue;
+        }
+        logFile << "Copied " << source.path << " to " << target.string() << "\n";
+        stats.copied++;
+        stats.copied_bytes += source.fingerprint.size;
+        FileRecord copy;
+        copy.path = target.string();
+        if (source.fingerprint.size > 0 && getFingerprint(copy.path, copy.fingerprint)) {
+            index.push_back(std::move(copy));
+            by_size[source.fingerprint.size].push_back(index.size() - 1);
+        }
+    }
+
+    // Children before parents, so setting a child's times does not change its parent's
+    for (auto it = created_directories.rbegin(); it != created_directories.rend(); ++it) {
+        struct stat dir_st;
+        if (stat(it->first.c_str(), &dir_st) != 0)
+            continue;
+        struct timespec times[2] = {dir_st.st_atim, dir_st.st_mtim};
+        if (chmod(it->second.c_str(), dir_st.st_mode & 07777) != 0 ||
+            utimensat(AT_FDCWD, it->second.c_str(), times, 0) != 0)
+            errorLog.add("Cannot set directory attributes", it->second.string(), std::strerror(errno));
     }
+    return stats;
 }
 
 // ------------------------------------------------------------------------------------
@@ -115,83 +3686,432 @@ bool isPathInDirectory(const std::string& filePath, const std::string& directory
 int main(int argc, char **argv) {
     using namespace std::chrono;
     int marked_for_deletion = 0;
-    std::unordered_map<std::string, std::vector<std::string>> filehashes;
     std::string algorithm = "SHA-256";  // Default set to SHA-256
 
-    // Argument processing: Check if -md5 or -sha256 flag is provided
-    if (argc > 1 && std::string(argv[1]) == "-md5") {
-        algorithm = "MD5";
+    bool scan_archives = false;
+    int archive_members = 0;
+
+    // Optional command: "scan --shard <file>" writes a partial result, "merge" combines
+    // them, "verify" re-reads cataloged files to detect silent corruption and "ingest"
+    // copies a tree while linking to content the destination already holds
+    std::string command;
+    std::string shardfile;
+    bool hash_all = false;
+    std::string compact_index_file;
+    std::string delete_scope_file;
+    bool use_quarantine = false;
+    bool prefix_copies = false;
+    std::vector<std::string> ext4_images;
+    double verify_percent = 100;
+    double verify_max_rate = 0;
+    std::vector<std::string> ingest_indexes;
+    std::string link_mode = "auto";
+    if (argc > 1 && (std::string(argv[1]) == "scan" || std::string(argv[1]) == "merge" ||
+                     std::string(argv[1]) == "verify" || std::string(argv[1]) == "ingest")) {
+        command = argv[1];
+        argv[1] = argv[0];
         argc--;
         argv++;
-    } else if (argc > 1 && (std::string(argv[1]) == "-sha256" || std::string(argv[1]) == "SHA-256")) {
-        algorithm = "SHA-256";
+    }
+
+    // Argument processing: options precede the directories
+    while (argc > 1 && (argv[1][0] == '-' || std::string(argv[1]) == "SHA-256")) {
+        std::string option = argv[1];
+        if (option == "-md5") {
+            algorithm = "MD5";
+        } else if (option == "-sha256" || option == "SHA-256") {
+            algorithm = "SHA-256";
+        } else if (option == "-archives") {
+            scan_archives = true;
+        } else if (option == "-compact-index" && argc > 2) {
+            compact_index_file = argv[2];
+            argv[2] = argv[0];
+            argc--;
+            argv++;
+        } else if (option == "-delete-scope" && argc > 2) {
+            delete_scope_file = argv[2];
+            argv[2] = argv[0];
+            argc--;
+            argv++;
+        } else if (option == "-io-profile" && argc > 2) {
+            std::string bad;
+            if (!ioProfiles.setOverrides(argv[2], bad)) {
+                std::cerr << "Invalid I/O profile setting: " << bad << std::endl;
+                return 1;
+            }
+            argv[2] = argv[0];
+            argc--;
+            argv++;
+        } else if (option == "-simulate-io" && argc > 2) {
+            auto simulated = dynamic_cast<SimulatedIoBackend*>(ioBackend.get());
+            if (!simulated) {
+                ioBackend = std::make_unique<SimulatedIoBackend>(std::move(ioBackend));
+                simulated = static_cast<SimulatedIoBackend*>(ioBackend.get());
+            }
+            std::string bad;
+            if (!simulated->configure(argv[2], bad)) {
+                std::cerr << "Invalid -simulate-io setting: " << bad << std::endl;
+                return 1;
+            }
+            argv[2] = argv[0];
+            argc--;
+            argv++;
+        } else if (option == "-prefix-copies" && command.empty()) {
+            prefix_copies = true;
+        } else if (option == "-ext4-image" && command.empty() && argc > 2) {
+#ifndef MYDUPEFINDER_WITH_EXT2FS
+            std::cerr << "Error: ext4 image support is not compiled in (build with -DMYDUPEFINDER_WITH_EXT2FS).\n";
+            return 1;
+#endif
+            ext4_images.push_back(argv[2]);
+            argv[2] = argv[0];
+            argc--;
+            argv++;
+        } else if (option == "-quarantine") {
+            use_quarantine = true;
+        } else if (option == "--hash-all" && command == "scan") {
+            hash_all = true;
+        } else if (option == "--shard" && command == "scan" && argc > 2) {
+            shardfile = argv[2];
+            argv[2] = argv[0];
+            argc--;
+            argv++;
+        } else if ((option == "--percent" || option == "--max-rate") && command == "verify" && argc > 2) {
+            try {
+                (option == "--percent" ? verify_percent : verify_max_rate) = std::stod(argv[2]);
+            } catch (const std::exception &e) {
+                std::cerr << "Invalid value for " << option << ": " << argv[2] << std::endl;
+                return 1;
+            }
+            argv[2] = argv[0];
+            argc--;
+            argv++;
+        } else if (option == "--index" && command == "ingest" && argc > 2) {
+            ingest_indexes.push_back(argv[2]);
+            argv[2] = argv[0];
+            argc--;
+            argv++;
+        } else if (option == "--link" && command == "ingest" && argc > 2) {
+            link_mode = argv[2];
+            if (link_mode != "auto" && link_mode != "reflink" && link_mode != "hard") {
+                std::cerr << "Invalid value for --link: " << link_mode << std::endl;
+                return 1;
+            }
+            argv[2] = argv[0];
+            argc--;
+            argv++;
+        } else if (option == "-help" || option == "--help") {
+            std::cout << "Usage: " << argv[0] << " [Options] <directory> [<directory> ...]\n";
+            std::cout << "       " << argv[0] << " scan --shard <file> [Options] <directory> [<directory> ...]\n";
+            std::cout << "       " << argv[0] << " merge <shard file> [<shard file> ...]\n";
+            std::cout << "       " << argv[0] << " verify [--percent <n>] [--max-rate <MiB/s>] <shard file> [...]\n";
+            std::cout << "       " << argv[0] << " ingest [--index <shard|dir>] [--link auto|reflink|hard] <src> <dst>\n";
+            std::cout << "Options:\n";
+            std::cout << "  -md5           Use MD5 hashing algorithm\n";
+            std::cout << "  -sha256        Use SHA-256 hashing algorithm (default)\n";
+            std::cout << "  -archives      Also hash members of zip, tar and tar.gz archives\n";
+            std::cout << "  -compact-index <file>  Keep only 64-bit keys in memory, full digests in <file>\n";
+            std::cout << "  -delete-scope <file>   Delete from the directories and globs listed in <file>\n";
+            std::cout << "                         instead of choosing directories interactively\n";
+            std::cout << "  -io-profile <key=value,...>  Override the detected I/O profiles: qd=<n>,\n";
+            std::cout << "                 block=<n>[K|M], read=mmap|pread, order=physical|walk,\n";
+            std::cout << "                 fadvise=none|sequential|noreuse\n";
+            std::cout << "  -simulate-io <key=value,...>  Simulate storage for testing: [dev=<maj>:<min>,]\n";
+            std::cout << "                 seek=<ms>,lat=<ms>,bw=<n>[K|M|G],qd=<n>,errors=<p>,seed=<n>\n";
+            std::cout << "  -prefix-copies Hash every file and report truncated copies of larger files\n";
+            std::cout << "  -ext4-image <image>  Also scan an unmounted ext2/3/4 image or block device\n";
+            std::cout << "                 through libext2fs; its files are reported, never deleted\n";
+            std::cout << "  -quarantine    Rename duplicates into a quarantine directory and purge them\n";
+            std::cout << "                 in the background with paced truncation (for huge files)\n";
+            std::cout << "  --shard <file> (scan) Write a partial result to <file> instead of deleting\n";
+            std::cout << "  --hash-all     (scan) Hash every file, so the shard can serve as a verify catalog\n";
+            std::cout << "  --percent <n>  (verify) Verify the next n% of the catalog (by bytes) per run\n";
+            std::cout << "  --max-rate <n> (verify) Read at most n MiB/s per device\n";
+            std::cout << "  --index <shard|dir> (ingest) Existing content to link to (default: <dst>)\n";
+            std::cout << "  --link <mode>  (ingest) auto (reflink, else hard link), reflink or hard\n";
+            return 0;
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        }
+        argv[1] = argv[0];
         argc--;
         argv++;
-    } else if (argc > 1 && (std::string(argv[1]) == "-help" || std::string(argv[1]) == "--help")) {
-        std::cout << "Usage: " << argv[0] << " [Options] <directory> [<directory> ...]\n";
-        std::cout << "Options:\n";
-        std::cout << "  -md5         Use MD5 hashing algorithm\n";
-        std::cout << "  -sha256      Use SHA-256 hashing algorithm (default)\n";
-        return 0;
     }
 
-    // Check if at least one directory is specified
-    if (argc < 2) {
-        std::cerr << "Error: At least one directory must be specified.\n";
-        std::cerr << "Usage: " << argv[0] << " [Options] <directory> [<directory> ...]\n";
+    // Check if at least one directory (or shard) is specified
+    if (command == "scan" && shardfile.empty()) {
+        std::cerr << "Error: scan requires --shard <file>.\n";
+        return 1;
+    }
+    if (command == "ingest" && argc != 3) {
+        std::cerr << "Error: ingest needs a source and a destination directory.\n";
+        std::cerr << "Usage: " << argv[0] << " ingest [--index <shard|dir>] [--link auto|reflink|hard] <src> <dst>\n";
+        return 1;
+    }
+    if (argc < 2 && ext4_images.empty()) {
+        if (command == "merge" || command == "verify") {
+            std::cerr << "Error: At least one shard file must be specified.\n";
+            std::cerr << "Usage: " << argv[0] << " " << command << " <shard file> [<shard file> ...]\n";
+        } else {
+            std::cerr << "Error: At least one directory must be specified.\n";
+            std::cerr << "Usage: " << argv[0] << " [Options] <directory> [<directory> ...]\n";
+        }
         return 1;
     }
 
+    // Directories to scan, or for a merge (verify) the union of the shards' directories
+    std::vector<std::string> roots;
+    std::vector<ShardReader> shards;
+    if (command == "merge" || command == "verify") {
+        try {
+            for (int i = 1; i < argc; i++) {
+                shards.emplace_back(argv[i]);
+                if (shards.back().algorithm() != shards.front().algorithm())
+                    throw std::runtime_error("shards use different hash algorithms: " + std::string(argv[i]));
+                for (const auto &root : shards.back().roots()) {
+                    if (std::find(roots.begin(), roots.end(), root) == roots.end())
+                        roots.push_back(root);
+                }
+            }
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        algorithm = shards.front().algorithm();
+    } else {
+        roots.assign(argv + 1, argv + argc);
+    }
+
+    // Ingest: the index of existing content comes from shard catalogs and directories
+    std::vector<FileRecord> ingest_index;
+    if (command == "ingest") {
+        std::error_code ec;
+        if (!std::filesystem::is_directory(roots[0], ec)) {
+            std::cerr << "Error: Source directory not found: " << roots[0] << std::endl;
+            return 1;
+        }
+        std::filesystem::create_directories(roots[1], ec);
+        if (ec) {
+            std::cerr << "Error: Cannot create " << roots[1] << ": " << ec.message() << std::endl;
+            return 1;
+        }
+        if (ingest_indexes.empty())
+            ingest_indexes.push_back(roots[1]);
+        std::vector<std::string> index_dirs;
+        std::string shard_algorithm;
+        try {
+            for (const auto &source : ingest_indexes) {
+                if (std::filesystem::is_directory(source, ec)) {
+                    index_dirs.push_back(source);
+                    continue;
+                }
+                ShardReader shard(source);
+                if (!shard_algorithm.empty() && shard.algorithm() != shard_algorithm)
+                    throw std::runtime_error("shards use different hash algorithms: " + source);
+                shard_algorithm = shard.algorithm();
+                FileRecord record;
+                while (shard.next(record))
+                    ingest_index.push_back(record);
+            }
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        if (!shard_algorithm.empty())
+            algorithm = shard_algorithm;
+        collectFiles(index_dirs, ingest_index);
+    }
+
     std::cout << "Used Algo: " << algorithm << std::endl;
 
+    DigestStore digests;
+    if (!compact_index_file.empty() && command != "verify" && !digests.open(compact_index_file)) {
+        std::cerr << "Error: Cannot create compact index file " << compact_index_file << std::endl;
+        return 1;
+    }
+
     // Initialize log file
     std::string logdate = getCurrentDateTime();
     std::string logfile = "log_" + logdate + ".txt";
+    if (command == "scan") {
+        // Several shard scans usually start together; keep their logs apart
+        logfile = "log_" + logdate + "_" + std::to_string(getpid()) + ".txt";
+    }
     std::ofstream logFile(logfile);
     logFile << "Log for the duplicate deletion script\n";
     logFile << "Date: " << logdate << "\n";
     logFile << "Using algorithm: " << algorithm << "\n";
+    if (command == "merge" || command == "verify") {
+        logFile << "Shards:\n";
+        for (const auto &shard : shards) {
+            logFile << "- " << shard.path() << "\n";
+        }
+    }
     logFile << "Directories:\n";
-    for (int i = 1; i < argc; i++) {
-        logFile << "- " << argv[i] << "\n";
+    for (const auto &root : roots) {
+        logFile << "- " << root << "\n";
+    }
+    if (!ext4_images.empty()) {
+        logFile << "ext4 images:\n";
+        for (const auto &image : ext4_images) {
+            logFile << "- " << image << "\n";
+        }
     }
     logFile << "-------------------\n";
+    errorLog.attach(logFile);
 
-    // Count total number of files in the specified directories
-    int total_files = 0;
-    for (int i = 1; i < argc; i++) {
-        if (!std::filesystem::exists(argv[i])) {
-            std::cerr << "Directory not found: " << argv[i] << std::endl;
+    // How each root's filesystem will be read
+    for (const auto &root : roots) {
+        struct stat st;
+        if (stat(root.c_str(), &st) != 0)
             continue;
+        std::string profile = ioProfiles.forDevice(st.st_dev, root).describe();
+        std::cout << "I/O profile " << root << ": " << profile << "\n";
+        logFile << "I/O profile " << root << ": " << profile << "\n";
+    }
+
+    // Verify re-reads cataloged files and never deletes anything
+    if (command == "verify") {
+        std::vector<FileRecord> records;
+        std::vector<std::pair<std::string, size_t>> cursors;  // saved once all is verified
+        try {
+            for (auto &shard : shards) {
+                std::vector<FileRecord> cataloged;
+                FileRecord record;
+                while (shard.next(record)) {
+                    // Lockstep group keys and archive members have no digest to check
+                    if (!record.hash().empty() && !record.archive_member && record.hash().compare(0, 6, "BYTES-") != 0)
+                        cataloged.push_back(record);
+                }
+                std::string cursorfile = shard.path() + ".cursor";
+                size_t next_cursor;
+                for (size_t index : selectRollingSlice(cataloged, verify_percent, cursorfile, next_cursor))
+                    records.push_back(std::move(cataloged[index]));
+                if (verify_percent < 100 && !cataloged.empty())
+                    cursors.emplace_back(cursorfile, next_cursor);
+            }
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
         }
-        for (const auto &entry : std::filesystem::recursive_directory_iterator(argv[i])) {
-            if (entry.is_regular_file()) {
-                total_files++;
+
+        auto results = verifyRecords(records, algorithm, verify_max_rate * 1024 * 1024, true);
+        for (const auto &[cursorfile, cursor] : cursors)
+            saveRollingCursor(cursorfile, cursor);
+        int counts[4] = {};
+        for (size_t i = 0; i < records.size(); i++) {
+            counts[results[i].outcome]++;
+            if (results[i].outcome == VERIFY_CORRUPT) {
+                // Through the error log, so a failing disk cannot flood the console
+                errorLog.add("Corrupt", records[i].path,
+                             "stored hash " + records[i].hash() + ", current hash " + results[i].hash);
+            } else if (results[i].outcome == VERIFY_MODIFIED) {
+                logFile << "Modified since cataloged " << records[i].path << "\n";
+            } else if (results[i].outcome == VERIFY_UNREADABLE) {
+                logFile << "Unreadable " << records[i].path << "\n";
             }
         }
+        std::ostringstream summary;
+        summary << "Verified " << records.size() << " files: " << counts[VERIFY_OK] << " OK, "
+                << counts[VERIFY_CORRUPT] << " corrupt, " << counts[VERIFY_MODIFIED] << " modified, "
+                << counts[VERIFY_UNREADABLE] << " unreadable.\n";
+        std::cout << summary.str();
+        errorLog.summarize(std::cout);
+        ioBackend->report(std::cout);
+        std::cout << "Check " << logfile << " for details.\n";
+        logFile << summary.str();
+        errorLog.summarize(logFile);
+        ioBackend->report(logFile);
+        return counts[VERIFY_CORRUPT] > 0 ? 2 : 0;
     }
 
-    // Select directories from which duplicates should be deleted
-    std::cout << "Choose directories to delete duplicates from (comma separated, e.g. 1,3,4):\n";
-    for (int i = 1; i < argc; i++) {
-        std::cout << i << ") " << argv[i] << "\n";
+    // Ingest copies new content only and never deletes anything
+    if (command == "ingest") {
+        IngestStats stats = ingestTree(roots[0], roots[1], ingest_index, algorithm, link_mode, logFile);
+        std::ostringstream summary;
+        summary << "Ingested " << stats.linked + stats.copied << " files: " << stats.linked << " linked to existing content ("
+                << formatBytes(stats.linked_bytes) << " not written), " << stats.copied << " copied ("
+                << formatBytes(stats.copied_bytes) << "), " << stats.existing << " already present, "
+                << stats.failed << " failed. " << stats.directories << " directories and " << stats.symlinks
+                << " symlinks recreated, " << stats.skipped << " special files skipped.\n";
+        std::cout << summary.str();
+        errorLog.summarize(std::cout);
+        ioBackend->report(std::cout);
+        std::cout << "Check " << logfile << " for details.\n";
+        logFile << summary.str();
+        errorLog.summarize(logFile);
+        ioBackend->report(logFile);
+        return stats.failed > 0 ? 1 : 0;
     }
-    std::string selection;
-    std::getline(std::cin, selection);
-    std::istringstream ss(selection);
-    std::string token;
-    std::vector<int> delete_indices;
-    while (std::getline(ss, token, ',')) {
-        try {
-            delete_indices.push_back(std::stoi(token));
-        } catch (const std::exception &e) {
-            std::cerr << "Invalid input: " << token << std::endl;
+
+    // Collect all files in the specified directories
+    std::vector<FileRecord> records;
+    if (command != "merge")
+        collectFiles(roots, records);
+
+    // A shard scan only hashes size collisions inside the shard and writes the result
+    if (command == "scan") {
+        // Shards must carry real digests so that they can be compared across shards
+        StagePlanner planner(algorithm);
+        hashCandidates(records, algorithm, scan_archives, planner, digests, false, true, true);
+        planner.report(logFile);
+        if (hash_all) {
+            std::vector<size_t> unhashed;
+            for (size_t i = 0; i < records.size(); i++) {
+                if (!records[i].hasDigest() && !records[i].archive_member)
+                    unhashed.push_back(i);
+            }
+            std::vector<FileRecord> no_members;
+            hashRecords(records, unhashed, algorithm, false, true, no_members);
+            for (size_t index : unhashed)
+                digests.compact(records[index]);
         }
+        if (!writeShard(shardfile, algorithm, roots, records, digests))
+            return 1;
+        int hashed = (int)std::count_if(records.begin(), records.end(),
+                                        [](const FileRecord &r) { return r.hasDigest(); });
+        std::cout << records.size() << " files (" << hashed << " hashed) written to shard "
+                  << shardfile << ".\n";
+        logFile << "Shard " << shardfile << ": " << records.size() << " files, " << hashed << " hashed\n";
+        errorLog.summarize(std::cout);
+        ioBackend->report(std::cout);
+        errorLog.summarize(logFile);
+        ioBackend->report(logFile);
+        return 0;
     }
-    std::vector<std::string> delete_dirs;
-    for (auto index : delete_indices) {
-        if (index >= 1 && index < argc)
-            delete_dirs.push_back(argv[index]);
+
+    // Select directories from which duplicates should be deleted: either a scope file
+    // of directories and globs, or roots chosen by number. Both compile into one matcher.
+    DeleteScope delete_scope;
+    if (!delete_scope_file.empty()) {
+        if (!delete_scope.load(delete_scope_file)) {
+            std::cerr << "Cannot read delete scope file: " << delete_scope_file << std::endl;
+            return 1;
+        }
+        std::cout << "Delete scope: " << delete_scope.size() << " entries from " << delete_scope_file << "\n";
+        logFile << "Delete scope: " << delete_scope.size() << " entries from " << delete_scope_file << "\n";
+    } else if (!roots.empty()) {
+        std::cout << "Choose directories to delete duplicates from (comma separated, e.g. 1,3,4):\n";
+        for (size_t i = 0; i < roots.size(); i++) {
+            std::cout << i + 1 << ") " << roots[i] << "\n";
+        }
+        std::string selection;
+        std::getline(std::cin, selection);
+        std::istringstream ss(selection);
+        std::string token;
+        std::vector<int> delete_indices;
+        while (std::getline(ss, token, ',')) {
+            try {
+                delete_indices.push_back(std::stoi(token));
+            } catch (const std::exception &e) {
+                std::cerr << "Invalid input: " << token << std::endl;
+            }
+        }
+        for (auto index : delete_indices) {
+            if (index >= 1 && index <= (int)roots.size())
+                delete_scope.addDirectory(roots[index - 1]);
+        }
     }
 
     // DRY run prompt (simulate deletion without actual file removal)
@@ -222,40 +4142,89 @@ int main(int argc, char **argv) {
         manual_delete = "dry";
     }
 
-    int current_file = 0;
-    auto start = steady_clock::now();
+    if (use_quarantine)
+        quarantine.enable(roots);
 
-    // Iterate through all specified directories and calculate the hash for each file
-    for (int i = 1; i < argc; i++) {
-        if (!std::filesystem::exists(argv[i]))
-            continue;
-        for (const auto &entry : std::filesystem::recursive_directory_iterator(argv[i])) {
-            if (entry.is_regular_file()) {
-                std::string path = std::filesystem::absolute(entry.path()).string();
-                std::string hash = getHash(path, algorithm);
-                // Only valid hashes are stored
-                if (!hash.empty()) {
-                    filehashes[hash].push_back(path);
-                }
-                current_file++;
-                int percent = (current_file * 100) / total_files;
-                auto elapsed = duration_cast<seconds>(steady_clock::now() - start);
-                int estimated_total = (elapsed.count() * total_files) / current_file;
-                if (manual_delete == "dry") {
-                    std::cout << "Calculating " << algorithm << " hashes: " 
-                              << current_file << "/" << total_files
-                              << " (" << percent << "%) Elapsed: " 
-                              << formatDuration(elapsed.count())
-                              << " Estimated Total: " 
-                              << formatDuration(estimated_total) << "\r" << std::flush;
-                }
-            }
+    // Files inside ext4 images take part like archive members
+    int image_files = 0;
+    if (!ext4_images.empty()) {
+        image_files = scanExt4Images(ext4_images, records, algorithm, prefix_copies, logFile);
+        if (image_files < 0)
+            return 1;
+    }
+
+    // Confirm every file that shares its size with another one (or merge the shards)
+    StagePlanner planner(algorithm);
+    if (command == "merge") {
+        int hashed_files = 0;
+        int cross_shard_groups = 0;
+        try {
+            cross_shard_groups = mergeShards(shards, algorithm, planner, digests, records, hashed_files);
+        } catch (const std::exception &e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        std::cout << "Merged " << shards.size() << " shards: " << cross_shard_groups
+                  << " cross-shard duplicate groups, " << hashed_files << " files hashed during merge.\n";
+        logFile << "Merged " << shards.size() << " shards: " << cross_shard_groups
+                << " cross-shard duplicate groups, " << hashed_files << " files hashed during merge\n";
+    } else if (prefix_copies) {
+        // One full pass over every file, taking prefix checkpoints, replaces the planner
+        std::vector<size_t> all_files;
+        for (size_t i = 0; i < records.size(); i++) {
+            if (!records[i].archive_member)
+                all_files.push_back(i);
+        }
+        planPrefixCheckpoints(records);
+        std::vector<FileRecord> member_records;
+        hashRecords(records, all_files, algorithm, scan_archives, true, member_records, true);
+        std::move(member_records.begin(), member_records.end(), std::back_inserter(records));
+        for (auto &record : records)
+            digests.compact(record);
+    } else {
+        hashCandidates(records, algorithm, scan_archives, planner, digests, true, false, manual_delete == "dry");
+    }
+    if (!prefix_copies) {
+        planner.report(std::cout);
+        planner.report(logFile);
+    }
+
+    // Group the records with equal content
+    std::vector<DuplicateGroup> groups = buildDuplicateGroups(records, digests);
+    archive_members = (int)std::count_if(records.begin(), records.end(),
+                                         [](const FileRecord &r) { return r.archive_member && r.hasDigest(); }) - image_files;
+
+    // Truncated or partial copies are reported, never deleted
+    if (prefix_copies) {
+        std::vector<PrefixCopy> copies = findPrefixCopies(records);
+        uint64_t prefix_bytes = 0;
+        for (const auto &copy : copies) {
+            const FileRecord &small = records[copy.copy];
+            const FileRecord &large = records[copy.original];
+            logFile << "Prefix copy " << small.path
+                    << " (" << small.fingerprint.size << " bytes) of " << large.path
+                    << " (" << large.fingerprint.size << " bytes)\n";
+            prefix_bytes += small.fingerprint.size;
         }
+        std::cout << copies.size() << " prefix copies found, " << formatBytes(prefix_bytes) << " in total.\n";
     }
-    std::cout << std::endl;
 
     // Process duplicates
-    for (const auto &[hash, files] : filehashes) {
+    int archive_duplicates = 0;
+    std::vector<PendingGroup> pending;
+    for (const auto &group : groups) {
+        const std::string &hash = group.hash;
+        // Fingerprint of every file as it was when hashed, re-checked before any action
+        std::vector<std::string> files;
+        std::unordered_map<std::string, FileFingerprint> fingerprints;
+        std::unordered_set<std::string> archive_member_paths;
+        for (size_t id : group.ids) {
+            files.push_back(records[id].path);
+            if (records[id].archive_member)
+                archive_member_paths.insert(records[id].path);
+            else
+                fingerprints[records[id].path] = records[id].fingerprint;
+        }
         if (files.size() > 1) {
             std::string duplicates;
             for (const auto &file : files) {
@@ -264,13 +4233,30 @@ int main(int argc, char **argv) {
             if (!duplicates.empty())
                 duplicates = duplicates.substr(0, duplicates.size() - 2); // Remove last comma
 
+            // Archive members are reported but can never be deleted
+            std::vector<std::string> disk_files;
+            std::string members;
+            for (const auto &file : files) {
+                if (archive_member_paths.count(file)) {
+                    members += (members.empty() ? "" : ", ") + file;
+                } else {
+                    disk_files.push_back(file);
+                }
+            }
+            if (!members.empty()) {
+                for (const auto &file : disk_files) {
+                    logFile << "Archive duplicate " << file
+                            << " (Hash: " << hash
+                            << ", Archive members: " << members << ")\n";
+                    archive_duplicates++;
+                }
+            }
+
             // Create a list of files that are located in the deletion directories
             std::vector<std::string> files_to_delete;
-            for (const auto &dir_to_delete : delete_dirs) {
-                for (const auto &file : files) {
-                    if (isPathInDirectory(file, dir_to_delete)) {
-                        files_to_delete.push_back(file);
-                    }
+            for (const auto &file : disk_files) {
+                if (delete_scope.matches(file)) {
+                    files_to_delete.push_back(file);
                 }
             }
 
@@ -284,86 +4270,77 @@ int main(int argc, char **argv) {
                 continue;
             }
 
-            // Manual deletion prompt: user explicitly selects which file to keep
+            // Manual mode: collect the group, decided later per directory cluster
             if (manual_delete == "y" || manual_delete == "Y") {
-                std::cout << "\nFound duplicates with hash " << hash << " in selected directories:\n";
-                for (size_t i = 0; i < files_to_delete.size(); i++) {
-                    std::cout << i + 1 << ") " << files_to_delete[i] << "\n";
-                }
-                std::cout << "Please select the file number to KEEP (others will be deleted), or 0 to skip deletion: ";
-                int keep_index;
-                std::cin >> keep_index;
-                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-                if (keep_index <= 0 || keep_index > (int)files_to_delete.size()) {
-                    // If 0 or invalid input, skip deletion for this group
-                    for (const auto &file : files_to_delete) {
-                        logFile << "Skipped " << file 
-                                << " (Hash: " << hash 
-                                << ", Duplicates: " << duplicates << ")\n";
-                    }
-                } else {
-                    // Delete all files except the one selected by the user
-                    for (size_t i = 0; i < files_to_delete.size(); i++) {
-                        if ((int)i == keep_index - 1) {
-                            logFile << "Kept " << files_to_delete[i] 
-                                    << " (Hash: " << hash 
-                                    << ", Duplicates: " << duplicates << ")\n";
-                            continue;
-                        }
-                        if (dry_run) {
-                            logFile << "DRY run: Would delete " << files_to_delete[i] 
-                                    << " (Hash: " << hash 
-                                    << ", Duplicates: " << duplicates << ")\n";
-                        } else {
-                            try {
-                                std::filesystem::remove(files_to_delete[i]);
-                                logFile << "Deleted " << files_to_delete[i] 
-                                        << " (Hash: " << hash 
-                                        << ", Duplicates: " << duplicates << ")\n";
-                                marked_for_deletion++;
-                            } catch (const std::filesystem::filesystem_error &e) {
-                                std::cerr << "Error deleting file: " << files_to_delete[i] 
-                                          << " - " << e.what() << std::endl;
-                                logFile << "Failed to delete " << files_to_delete[i] 
-                                        << " - " << e.what() << "\n";
-                            }
-                        }
-                    }
-                }
+                PendingGroup pending_group;
+                pending_group.hash = hash;
+                pending_group.duplicates = duplicates;
+                pending_group.files_to_delete = files_to_delete;
+                pending_group.fingerprints = fingerprints;
+                pending_group.reclaimable = (uint64_t)records[group.ids.front()].fingerprint.size * (files_to_delete.size() - 1);
+                pending.push_back(std::move(pending_group));
             } else {
                 // Automatic mode: if all duplicates are in the deletion directories,
                 // keep one file and delete the rest.
-                if (files_to_delete.size() == files.size() && !files_to_delete.empty()) {
+                if (files_to_delete.size() == disk_files.size() && !files_to_delete.empty()) {
                     // Log the kept file before deletion.
                     logFile << "Kept " << files_to_delete[0] 
                             << " (Hash: " << hash 
                             << ", Duplicates: " << duplicates << ")\n";
                     files_to_delete.erase(files_to_delete.begin());
                 }
+
+                // At least one surviving copy must still match the hash, and it must be
+                // a different file (not a hard link of the one being deleted)
+                std::vector<std::string> survivors;
+                for (const auto &file : disk_files) {
+                    if (std::find(files_to_delete.begin(), files_to_delete.end(), file) == files_to_delete.end() &&
+                        isUnchanged(file, fingerprints))
+                        survivors.push_back(file);
+                }
                 for (const auto &file_to_delete : files_to_delete) {
-                    if (dry_run) {
-                        logFile << "DRY run: Would delete " << file_to_delete 
+                    bool other_survivor = std::any_of(survivors.begin(), survivors.end(), [&](const std::string &kept) {
+                        return !isSameFile(file_to_delete, kept, fingerprints);
+                    });
+                    if (!other_survivor && !survivors.empty()) {
+                        logFile << "Same file as the kept copy, skipped " << file_to_delete
+                                << " (Hash: " << hash
+                                << ", Duplicates: " << duplicates << ")\n";
+                        continue;
+                    }
+                    if (survivors.empty() || !isUnchanged(file_to_delete, fingerprints)) {
+                        logFile << "Changed since hashing, skipped " << file_to_delete 
                                 << " (Hash: " << hash 
                                 << ", Duplicates: " << duplicates << ")\n";
-                    } else {
-                        try {
-                            std::filesystem::remove(file_to_delete);
-                            logFile << "Deleted " << file_to_delete 
-                                    << " (Hash: " << hash 
-                                    << ", Duplicates: " << duplicates << ")\n";
-                            marked_for_deletion++;
-                        } catch (const std::filesystem::filesystem_error &e) {
-                            std::cerr << "Error deleting file: " << file_to_delete 
-                                      << " - " << e.what() << std::endl;
-                            logFile << "Failed to delete " << file_to_delete 
-                                    << " - " << e.what() << "\n";
-                        }
+                        continue;
                     }
+                    if (removeDuplicate(file_to_delete, hash, duplicates, dry_run, logFile))
+                        marked_for_deletion++;
                 }
             }
         }
     }
 
+    if (!pending.empty())
+        marked_for_deletion += reviewPendingGroups(pending, dry_run, logFile);
+
+    if (quarantine.enabled()) {
+        quarantine.report(std::cout);
+        quarantine.report(logFile);
+        std::cout << "Waiting for the purger to finish...\n";
+        quarantine.finish();
+        quarantine.report(std::cout);
+        quarantine.report(logFile);
+    }
+
+    if (archive_members > 0) {
+        std::cout << archive_members << " archive members hashed, "
+                  << archive_duplicates << " files duplicate an archive member.\n";
+    }
+    errorLog.summarize(std::cout);
+    ioBackend->report(std::cout);
+    errorLog.summarize(logFile);
+    ioBackend->report(logFile);
     std::cout << marked_for_deletion << " Dup Files processed.\nDone. Check " 
               << logfile << " for details.\n";
     logFile.close();